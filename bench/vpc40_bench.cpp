@@ -0,0 +1,329 @@
+// Headless micro-benchmark for Vpc40Module::process.
+// Drives the module from a minimal stand-in engine loop and a stand-in MIDI driver,
+// so the per-sample cost can be measured outside a running Rack instance.
+// Before measuring, it checks the messages flushed for an RGB pad and exits with 1 if they are wrong.
+//
+// Build and run with `make bench`, optionally `build/vpc40_bench [sampleRate] [seconds]`.
+
+// The module is defined in a single translation unit, so it is included here
+// to give the benchmark access to its ports.
+#include "../src/Vpc40.cpp"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+
+static const int BENCH_DRIVER_ID = 1000;
+static const int BENCH_BLOCK_FRAMES = 256;
+// each scenario is run this many times and the fastest run is reported
+static const int BENCH_REPEATS = 3;
+
+struct BenchInputDevice : midi::InputDevice {
+    std::string getName() override {
+        return "Bench APC40";
+    }
+};
+
+struct BenchOutputDevice : midi::OutputDevice {
+    // counted on the hub's sender thread
+    std::atomic<uint64_t> sent{0};
+    // while set, the messages are also kept, read once the hub is deleted
+    std::atomic<bool> recording{false};
+    std::vector<Message> recorded;
+
+    std::string getName() override {
+        return "Bench APC40";
+    }
+
+    void sendMessage(const Message& msg) override {
+        sent++;
+        if (recording) {
+            recorded.push_back(msg);
+        }
+    }
+};
+
+struct BenchDriver : midi::Driver {
+    BenchInputDevice inputDevice;
+    BenchOutputDevice outputDevice;
+
+    std::string getName() override {
+        return "Bench";
+    }
+    std::vector<int> getInputDeviceIds() override {
+        return {0};
+    }
+    std::string getInputDeviceName(int deviceId) override {
+        return inputDevice.getName();
+    }
+    midi::InputDevice* subscribeInput(int deviceId, midi::Input* input) override {
+        if (deviceId != 0) return NULL;
+        inputDevice.subscribe(input);
+        return &inputDevice;
+    }
+    void unsubscribeInput(int deviceId, midi::Input* input) override {
+        inputDevice.unsubscribe(input);
+    }
+    std::vector<int> getOutputDeviceIds() override {
+        return {0};
+    }
+    std::string getOutputDeviceName(int deviceId) override {
+        return outputDevice.getName();
+    }
+    midi::OutputDevice* subscribeOutput(int deviceId, midi::Output* output) override {
+        if (deviceId != 0) return NULL;
+        outputDevice.subscribe(output);
+        return &outputDevice;
+    }
+    void unsubscribeOutput(int deviceId, midi::Output* output) override {
+        outputDevice.unsubscribe(output);
+    }
+};
+
+// Pushes the inbound messages of one block into the driver, returns the number of messages.
+typedef std::function<int(BenchDriver& driver, int64_t frame, int block)> BlockFeeder;
+
+struct Scenario {
+    const char* name;
+    BlockFeeder feed;
+    // every track audio input is connected and fed a signal
+    bool audio;
+};
+
+static void sendInbound(BenchDriver& driver, int64_t frame, uint8_t status, uint8_t channel, uint8_t note, uint8_t value) {
+    Message msg;
+    // the frame must be set, otherwise the input port asks the engine for a timestamp
+    msg.setFrame(frame);
+    msg.setStatus(status);
+    msg.setChannel(channel);
+    msg.setNote(note);
+    msg.setValue(value);
+    driver.inputDevice.onMessage(msg);
+}
+
+static void connectOutputs(Vpc40Module* module, bool connect) {
+    for (int i = 0; i < Vpc40Module::NUM_OUTPUTS; i++) {
+        // mirror what the engine does when a cable is added or removed
+        module->outputs[i].channels = connect ? 1 : 0;
+        Module::PortChangeEvent e;
+        e.connecting = connect;
+        e.type = rack::engine::Port::OUTPUT;
+        e.portId = i;
+        module->onPortChange(e);
+    }
+}
+
+static void connectAudioInputs(Vpc40Module* module) {
+    for (int t = 0; t < CHAN_NUM; t++) {
+        module->inputs[Vpc40Module::TRACK_AUDIO_1_INPUT + t].channels = 1;
+    }
+}
+
+// Generates the track audio of one block, before the block is timed.
+static void generateAudio(float audio[][CHAN_NUM], int64_t frame) {
+    // a different ramp per track, so nothing is constant
+    for (int i = 0; i < BENCH_BLOCK_FRAMES; i++) {
+        for (int t = 0; t < CHAN_NUM; t++) {
+            audio[i][t] = (float) (((frame + i) * (t + 1)) % 200) / 20.f - 5.f;
+        }
+    }
+}
+
+struct Result {
+    double nsPerSample;
+    uint64_t inbound;
+    uint64_t outbound;
+};
+
+static Result runScenario(BenchDriver& driver, const Scenario& scenario, bool outputsConnected, float sampleRate, int blocks) {
+    driver.outputDevice.sent = 0;
+    Vpc40Module* module = new Vpc40Module;
+    module->ioPort.setDriverId(BENCH_DRIVER_ID);
+    module->ioPort.setDeviceId(0);
+    // done by the module widget in Rack
+    module->updateHub();
+    connectOutputs(module, outputsConnected);
+    if (scenario.audio) {
+        connectAudioInputs(module);
+    }
+
+    Module::SampleRateChangeEvent e;
+    e.sampleRate = sampleRate;
+    e.sampleTime = 1.f / sampleRate;
+    module->onSampleRateChange(e);
+
+    Module::ProcessArgs args;
+    args.sampleRate = sampleRate;
+    args.sampleTime = 1.f / sampleRate;
+    args.frame = 0;
+
+    uint64_t inbound = 0;
+    static float audio[BENCH_BLOCK_FRAMES][CHAN_NUM];
+    std::chrono::steady_clock::duration elapsed{0};
+    for (int b = 0; b < blocks; b++) {
+        // messages are stamped with the first frame of the block, like a driver delivering a burst
+        inbound += scenario.feed(driver, args.frame, b);
+        if (scenario.audio) {
+            generateAudio(audio, args.frame);
+        }
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < BENCH_BLOCK_FRAMES; i++) {
+            if (scenario.audio) {
+                // what the engine's cables do between two process calls
+                for (int t = 0; t < CHAN_NUM; t++) {
+                    module->inputs[Vpc40Module::TRACK_AUDIO_1_INPUT + t].setVoltage(audio[i][t]);
+                }
+            }
+            module->process(args);
+            args.frame++;
+        }
+        elapsed += std::chrono::steady_clock::now() - start;
+    }
+
+    Result result;
+    double ns = std::chrono::duration<double, std::nano>(elapsed).count();
+    result.nsPerSample = ns / ((double) blocks * BENCH_BLOCK_FRAMES);
+    result.inbound = inbound;
+    // deleting the module deletes the hub, whose sender writes what is still in its ring before it is joined
+    delete module;
+    result.outbound = driver.outputDevice.sent;
+    return result;
+}
+
+// Checks the messages an RGB pad is sent when a blink is replaced by a steady color before it was flushed,
+// the pad must end steady, so the blink may not follow the color.
+static bool checkBlinkReplaced(BenchDriver& driver, float sampleRate) {
+    Vpc40Module* module = new Vpc40Module;
+    module->ioPort.setDriverId(BENCH_DRIVER_ID);
+    module->ioPort.setDeviceId(0);
+    module->updateHub();
+    module->controller = &ptone::controllerProfile(ptone::Apc40Mk2::MODEL_ID);
+    Module::SampleRateChangeEvent e;
+    e.sampleRate = sampleRate;
+    e.sampleTime = 1.f / sampleRate;
+    module->onSampleRateChange(e);
+    Module::ProcessArgs args;
+    args.sampleRate = sampleRate;
+    args.sampleTime = 1.f / sampleRate;
+    args.frame = 0;
+    // the whole initial state is flushed first
+    for (; args.frame < (int64_t) sampleRate; args.frame++) {
+        module->process(args);
+    }
+    // popped once written, so the sender is done with it
+    while (!module->hub->outbound.empty()) {
+        std::this_thread::yield();
+    }
+
+    driver.outputDevice.recorded.clear();
+    driver.outputDevice.recording = true;
+    // routed like setLed does for track 1
+    uint8_t note = module->controller->leds[LED_CLIP_LAUNCH_1].note;
+    module->setLedOn(0, LED_CLIP_LAUNCH_1, LED_GREEN_BLINK);
+    module->setLedOn(0, LED_CLIP_LAUNCH_1, LED_GREEN);
+    for (int i = 0; i <= module->flushPeriodFrames; i++, args.frame++) {
+        module->process(args);
+    }
+    const ptone::LedColor& green = module->controller->colors[LED_GREEN];
+    // deleting the module joins the sender, the recorded messages are complete
+    delete module;
+    driver.outputDevice.recording = false;
+
+    std::vector<Message> pad;
+    for (const Message& msg : driver.outputDevice.recorded) {
+        if (msg.getSize() == 3 && msg.getNote() == note) {
+            pad.push_back(msg);
+        }
+    }
+    return pad.size() == 1 && pad[0].getStatus() == STATUS_NOTE_ON && pad[0].getChannel() == 0 && pad[0].getValue() == green.velocity;
+}
+
+int main(int argc, char* argv[]) {
+    float sampleRate = argc > 1 ? std::atof(argv[1]) : 48000.f;
+    float seconds = argc > 2 ? std::atof(argv[2]) : 5.f;
+    int blocks = std::max(1, (int) (sampleRate * seconds / BENCH_BLOCK_FRAMES));
+
+    BenchDriver* driver = new BenchDriver;
+    midi::addDriver(BENCH_DRIVER_ID, driver);
+
+    // the first scenario is the idle baseline that ns/msg is measured against
+    std::vector<Scenario> scenarios = {
+        {"idle", [](BenchDriver& d, int64_t frame, int block) {
+            return 0;
+        }, false},
+        {"dense knob CCs", [](BenchDriver& d, int64_t frame, int block) {
+            // every device and track knob moves once per block
+            uint8_t value = block & 0x7F;
+            for (int k = 0; k < C_KNOB_NUM; k++) {
+                sendInbound(d, frame, STATUS_CC, 0, C_DEVICE_KNOB_1 + k, value);
+                sendInbound(d, frame, STATUS_CC, 0, C_TRACK_KNOB_1 + k, value);
+            }
+            return 2 * C_KNOB_NUM;
+        }, false},
+        {"fader sweep", [](BenchDriver& d, int64_t frame, int block) {
+            uint8_t value = block & 0x7F;
+            for (int t = 0; t < CHAN_NUM; t++) {
+                sendInbound(d, frame, STATUS_CC, t, C_TRACK_LEVEL, value);
+            }
+            sendInbound(d, frame, STATUS_CC, 0, C_MASTER_LEVEL, value);
+            sendInbound(d, frame, STATUS_CC, 0, C_CROSSFADER, value);
+            sendInbound(d, frame, STATUS_CC, 0, C_CUE_LEVEL, (block & 1) ? 0x01 : 0x7F);
+            return CHAN_NUM + 3;
+        }, false},
+        {"bank switching", [](BenchDriver& d, int64_t frame, int block) {
+            sendInbound(d, frame, STATUS_NOTE_ON, 0, (block & 8) ? BTN_LEFT : BTN_RIGHT, 0x7F);
+            sendInbound(d, frame, STATUS_NOTE_OFF, 0, (block & 8) ? BTN_LEFT : BTN_RIGHT, 0x00);
+            return 2;
+        }, false},
+        {"clip LED presses", [](BenchDriver& d, int64_t frame, int block) {
+            // press on one block, release on the next
+            uint8_t track = (block / 2) % CHAN_NUM;
+            uint8_t led = LED_RECORD + (block / (2 * CHAN_NUM)) % CHAN_LED_NUM;
+            sendInbound(d, frame, (block & 1) ? STATUS_NOTE_OFF : STATUS_NOTE_ON, track, led, 0x7F);
+            return 1;
+        }, false},
+        {"mixer fader moves", [](BenchDriver& d, int64_t frame, int block) {
+            // half of the tracks are faded in and out, the others are silent
+            uint8_t value = (block & 0x40) ? 0x7F - (block & 0x3F) : (block & 0x3F);
+            for (int t = 0; t < CHAN_NUM; t += 2) {
+                sendInbound(d, frame, STATUS_CC, t, C_TRACK_LEVEL, value);
+            }
+            sendInbound(d, frame, STATUS_CC, 0, C_MASTER_LEVEL, 0x7F);
+            return CHAN_NUM / 2 + 1;
+        }, true},
+    };
+
+    if (!checkBlinkReplaced(*driver, sampleRate)) {
+        printf("an RGB pad turned steady was sent its blink afterwards\n");
+        return 1;
+    }
+
+    // warm up caches and clocks before anything is measured
+    runScenario(*driver, scenarios.front(), true, sampleRate, blocks);
+
+    printf("Vpc40Module::process, %.0f Hz, %d frames/block, %d blocks\n", sampleRate, BENCH_BLOCK_FRAMES, blocks);
+    printf("%-20s %-8s %12s %12s %10s %10s\n", "scenario", "outputs", "ns/sample", "ns/msg", "msgs in", "msgs out");
+    double idleNsPerSample[2] = {0.0, 0.0};
+    for (const Scenario& scenario : scenarios) {
+        for (bool connected : {false, true}) {
+            Result r = runScenario(*driver, scenario, connected, sampleRate, blocks);
+            for (int i = 1; i < BENCH_REPEATS; i++) {
+                Result repeat = runScenario(*driver, scenario, connected, sampleRate, blocks);
+                if (repeat.nsPerSample < r.nsPerSample) r = repeat;
+            }
+            if (&scenario == &scenarios.front()) {
+                idleNsPerSample[connected] = r.nsPerSample;
+            }
+            // cost on top of the idle baseline, spread over the inbound messages,
+            // a scenario measured below the baseline is within noise and costs nothing
+            double nsPerMessage = 0.0;
+            if (r.inbound) {
+                double samples = (double) blocks * BENCH_BLOCK_FRAMES;
+                nsPerMessage = std::max(0.0, r.nsPerSample - idleNsPerSample[connected]) * samples / r.inbound;
+            }
+            printf("%-20s %-8s %12.2f %12.2f %10llu %10llu\n", scenario.name, connected ? "all" : "none",
+                r.nsPerSample, nsPerMessage, (unsigned long long) r.inbound, (unsigned long long) r.outbound);
+        }
+    }
+    return 0;
+}
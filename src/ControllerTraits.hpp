@@ -0,0 +1,327 @@
+#pragma once
+#include <cstdint>
+#include "IndexList.hpp"
+#include "Vpc40Expander.hpp"
+#include "vpc_protocol.hpp"
+
+namespace ptone {
+
+/** What an inbound note or CC controls. The module switches on it, which compiles to one indexed jump. */
+enum Control {
+    CONTROL_NONE,
+    // notes
+    CONTROL_TRACK_LED,
+    CONTROL_SCENE_LAUNCH,
+    CONTROL_BANK_RIGHT,
+    CONTROL_BANK_LEFT,
+    CONTROL_SHIFT,
+    CONTROL_TAP_TEMPO,
+    CONTROL_NUDGE_PLUS,
+    CONTROL_NUDGE_MINUS,
+    CONTROL_PLAY,
+    CONTROL_RECORD,
+    // CCs
+    CONTROL_DEVICE_KNOB,
+    CONTROL_TRACK_KNOB,
+    CONTROL_TRACK_LEVEL,
+    CONTROL_MASTER_LEVEL,
+    CONTROL_CROSSFADER,
+    CONTROL_CUE_LEVEL,
+    NUM_CONTROLS
+};
+
+/** A dispatch table entry, the control of one note or CC number. */
+struct ControlEntry {
+    uint8_t control;
+    // the LED row, scene or knob within the control
+    uint8_t index;
+    // the channel on the button trigger and gate outputs, see TriggerButton, or -1
+    int8_t trigger;
+    // the track of a control that is not sent on its track's channel, or -1
+    int8_t track;
+};
+
+constexpr ControlEntry controlEntry(int control, int index = 0, int trigger = -1, int track = -1) {
+    return ControlEntry{(uint8_t) control, (uint8_t) index, (int8_t) trigger, (int8_t) track};
+}
+
+enum LedRouteKind {
+    // the controller has no such LED
+    ROUTE_NONE,
+    // same channel and note
+    ROUTE_SAME,
+    // one note per track on the first channel, the route's note plus the track
+    ROUTE_TRACK_NOTES
+};
+
+/** Where an LED the module addresses by the original APC40's channel and note is on a controller. */
+struct LedRoute {
+    uint8_t kind;
+    uint8_t note;
+    // the LED takes an RGB palette index, see LedColor
+    bool rgb;
+};
+
+constexpr LedRoute ledRoute(int kind, int note, bool rgb = false) {
+    return LedRoute{(uint8_t) kind, (uint8_t) note, rgb};
+}
+
+/** An RGB pad's velocity and the channel that selects its blinking, 0 for steady. */
+struct LedColor {
+    uint8_t velocity;
+    uint8_t channel;
+};
+
+/** The original APC40 in Ableton mode 2, and the layout the module's state follows.
+A controller is described by constexpr functions of the note or CC number,
+Dispatch<Controller> expands them into its tables.
+Inbound controls map to the APC40's, outbound LEDs are routed from the APC40's notes.
+*/
+struct Apc40 {
+    static constexpr int TRACKS = CHAN_NUM;
+    static constexpr int TRACK_LEDS = CHAN_LED_NUM;
+    static constexpr int CLIP_ROWS = LED_CLIP_LAUNCH_5 - LED_CLIP_LAUNCH_1 + 1;
+    static constexpr int KNOBS = C_KNOB_NUM;
+    // model byte of the SysEx identity reply
+    static constexpr uint8_t MODEL_ID = 0x73;
+    // switched to Ableton mode by the introduction SysEx
+    static constexpr bool INTRODUCED = true;
+
+    static constexpr int trigger(int note) {
+        return note == BTN_PLAY ? TRIGGER_PLAY
+            : note == BTN_STOP ? TRIGGER_STOP
+            : note == BTN_RECORD ? TRIGGER_RECORD
+            : note == BTN_UP ? TRIGGER_UP
+            : note == BTN_DOWN ? TRIGGER_DOWN
+            : note == LED_STOP_ALL_CLIPS ? TRIGGER_STOP_ALL_CLIPS
+            : note >= LED_SCENE_LAUNCH_1 && note <= LED_SCENE_LAUNCH_5 ? TRIGGER_SCENE_1 + note - LED_SCENE_LAUNCH_1
+            : note == LED_MASTER ? TRIGGER_MASTER
+            : -1;
+    }
+
+    static constexpr ControlEntry noteOn(int note) {
+        return note >= LED_RECORD && note <= LED_CLIP_LAUNCH_5 ? controlEntry(CONTROL_TRACK_LED, note - LED_RECORD)
+            : note >= LED_SCENE_LAUNCH_1 && note <= LED_SCENE_LAUNCH_5 ? controlEntry(CONTROL_SCENE_LAUNCH, note - LED_SCENE_LAUNCH_1, trigger(note))
+            : note == BTN_RIGHT ? controlEntry(CONTROL_BANK_RIGHT)
+            : note == BTN_LEFT ? controlEntry(CONTROL_BANK_LEFT)
+            : note == BTN_SHIFT ? controlEntry(CONTROL_SHIFT)
+            : note == BTN_TAP_TEMPO ? controlEntry(CONTROL_TAP_TEMPO)
+            : note == BTN_NUDGE_PLUS ? controlEntry(CONTROL_NUDGE_PLUS)
+            : note == BTN_NUDGE_MINUS ? controlEntry(CONTROL_NUDGE_MINUS)
+            : note == BTN_PLAY ? controlEntry(CONTROL_PLAY, 0, trigger(note))
+            : note == BTN_RECORD ? controlEntry(CONTROL_RECORD, 0, trigger(note))
+            : controlEntry(CONTROL_NONE, 0, trigger(note));
+    }
+
+    // only held controls react to their release
+    static constexpr ControlEntry noteOff(int note) {
+        return note >= LED_RECORD && note <= LED_CLIP_LAUNCH_5 ? controlEntry(CONTROL_TRACK_LED, note - LED_RECORD)
+            : note == BTN_SHIFT ? controlEntry(CONTROL_SHIFT)
+            : note == BTN_NUDGE_PLUS ? controlEntry(CONTROL_NUDGE_PLUS)
+            : note == BTN_NUDGE_MINUS ? controlEntry(CONTROL_NUDGE_MINUS)
+            : controlEntry(CONTROL_NONE, 0, trigger(note));
+    }
+
+    static constexpr ControlEntry cc(int cc) {
+        return cc >= C_DEVICE_KNOB_1 && cc <= C_DEVICE_KNOB_8 ? controlEntry(CONTROL_DEVICE_KNOB, cc - C_DEVICE_KNOB_1)
+            : cc >= C_TRACK_KNOB_1 && cc <= C_TRACK_KNOB_8 ? controlEntry(CONTROL_TRACK_KNOB, cc - C_TRACK_KNOB_1)
+            : cc == C_TRACK_LEVEL ? controlEntry(CONTROL_TRACK_LEVEL)
+            : cc == C_MASTER_LEVEL ? controlEntry(CONTROL_MASTER_LEVEL)
+            : cc == C_CROSSFADER ? controlEntry(CONTROL_CROSSFADER)
+            : cc == C_CUE_LEVEL ? controlEntry(CONTROL_CUE_LEVEL)
+            : controlEntry(CONTROL_NONE);
+    }
+
+    static constexpr LedRoute led(int note) {
+        return ledRoute(ROUTE_SAME, note);
+    }
+
+    // the knob rings
+    static constexpr bool sendsCc(int cc) {
+        return true;
+    }
+
+    static constexpr LedColor color(int value) {
+        return LedColor{(uint8_t) value, 0};
+    }
+};
+
+/** The APC40 mkII in Ableton mode 2.
+Its 5 by 8 clip grid sends one note per pad on the first channel, top row first, and takes RGB palette colors,
+as do the scene launch buttons. Nudge minus and plus are swapped, the rest matches the APC40.
+*/
+struct Apc40Mk2 : Apc40 {
+    static constexpr uint8_t MODEL_ID = 0x29;
+    static constexpr int PADS = CLIP_ROWS * TRACKS;
+    // channel of the pad blinking in quarter notes
+    static constexpr uint8_t BLINK_CHANNEL = 14;
+
+    static constexpr ControlEntry pad(int note) {
+        return controlEntry(CONTROL_TRACK_LED, LED_CLIP_LAUNCH_1 - LED_RECORD + CLIP_ROWS - 1 - note / TRACKS, -1, note % TRACKS);
+    }
+
+    static constexpr ControlEntry noteOn(int note) {
+        return note < PADS ? pad(note)
+            : note == BTN_NUDGE_PLUS ? controlEntry(CONTROL_NUDGE_MINUS)
+            : note == BTN_NUDGE_MINUS ? controlEntry(CONTROL_NUDGE_PLUS)
+            : Apc40::noteOn(note);
+    }
+
+    static constexpr ControlEntry noteOff(int note) {
+        return note < PADS ? pad(note) : Apc40::noteOff(note);
+    }
+
+    static constexpr LedRoute led(int note) {
+        return note >= LED_CLIP_LAUNCH_1 && note <= LED_CLIP_LAUNCH_5 ? ledRoute(ROUTE_TRACK_NOTES, (LED_CLIP_LAUNCH_5 - note) * TRACKS, true)
+            : note >= LED_SCENE_LAUNCH_1 && note <= LED_SCENE_LAUNCH_5 ? ledRoute(ROUTE_SAME, note, true)
+            : ledRoute(ROUTE_SAME, note);
+    }
+
+    // the APC40's green, red and yellow, steady and blinking
+    static constexpr LedColor color(int value) {
+        return value == LED_GREEN ? LedColor{21, 0}
+            : value == LED_GREEN_BLINK ? LedColor{21, BLINK_CHANNEL}
+            : value == LED_RED ? LedColor{5, 0}
+            : value == LED_RED_BLINK ? LedColor{5, BLINK_CHANNEL}
+            : value == LED_YELLOW ? LedColor{13, 0}
+            : value == LED_YELLOW_BLINK ? LedColor{13, BLINK_CHANNEL}
+            : LedColor{(uint8_t) value, 0};
+    }
+};
+
+/** The APC mini, which needs no introduction and has no knobs.
+Its 8 by 8 grid sends one note per pad on the first channel, bottom row first.
+The top five rows are the clip launch rows, the bottom three clip stop, solo and record,
+the track buttons below the grid are the activators and the faders send one CC per track.
+*/
+struct ApcMini : Apc40 {
+    static constexpr uint8_t MODEL_ID = 0x28;
+    static constexpr int GRID_ROWS = 8;
+    static constexpr int PADS = GRID_ROWS * TRACKS;
+    static constexpr int TRACK_BUTTON_1 = 0x40;
+    static constexpr int FADER_1 = 0x30;
+    static constexpr int MASTER_FADER = 0x38;
+    static constexpr bool INTRODUCED = false;
+
+    // LED row of a grid row counted from the top
+    static constexpr int gridLed(int row) {
+        return row < CLIP_ROWS ? LED_CLIP_LAUNCH_1 - LED_RECORD + row
+            : row == CLIP_ROWS ? LED_CLIP_STOP - LED_RECORD
+            : row == CLIP_ROWS + 1 ? LED_SOLO - LED_RECORD
+            : LED_RECORD - LED_RECORD;
+    }
+
+    // first note of the grid row showing an LED row, or -1
+    static constexpr int gridNote(int led) {
+        return led >= LED_CLIP_LAUNCH_1 - LED_RECORD ? (GRID_ROWS - 1 - (led - (LED_CLIP_LAUNCH_1 - LED_RECORD))) * TRACKS
+            : led == LED_CLIP_STOP - LED_RECORD ? 2 * TRACKS
+            : led == LED_SOLO - LED_RECORD ? TRACKS
+            : led == LED_RECORD - LED_RECORD ? 0
+            : -1;
+    }
+
+    static constexpr ControlEntry noteOn(int note) {
+        return note < PADS ? controlEntry(CONTROL_TRACK_LED, gridLed(GRID_ROWS - 1 - note / TRACKS), -1, note % TRACKS)
+            : note >= TRACK_BUTTON_1 && note < TRACK_BUTTON_1 + TRACKS ? controlEntry(CONTROL_TRACK_LED, LED_ACTIVATOR - LED_RECORD, -1, note - TRACK_BUTTON_1)
+            : note >= LED_SCENE_LAUNCH_1 && note <= LED_SCENE_LAUNCH_5 ? Apc40::noteOn(note)
+            : note == BTN_SHIFT ? controlEntry(CONTROL_SHIFT)
+            : controlEntry(CONTROL_NONE);
+    }
+
+    static constexpr ControlEntry noteOff(int note) {
+        return note < PADS || (note >= TRACK_BUTTON_1 && note < TRACK_BUTTON_1 + TRACKS) ? noteOn(note)
+            : note >= LED_SCENE_LAUNCH_1 && note <= LED_SCENE_LAUNCH_5 ? Apc40::noteOff(note)
+            : note == BTN_SHIFT ? controlEntry(CONTROL_SHIFT)
+            : controlEntry(CONTROL_NONE);
+    }
+
+    static constexpr ControlEntry cc(int cc) {
+        return cc >= FADER_1 && cc < FADER_1 + TRACKS ? controlEntry(CONTROL_TRACK_LEVEL, 0, -1, cc - FADER_1)
+            : cc == MASTER_FADER ? controlEntry(CONTROL_MASTER_LEVEL)
+            : controlEntry(CONTROL_NONE);
+    }
+
+    static constexpr LedRoute led(int note) {
+        return note >= LED_RECORD && note <= LED_CLIP_LAUNCH_5 && gridNote(note - LED_RECORD) >= 0 ? ledRoute(ROUTE_TRACK_NOTES, gridNote(note - LED_RECORD))
+            : note == LED_ACTIVATOR ? ledRoute(ROUTE_TRACK_NOTES, TRACK_BUTTON_1)
+            : note >= LED_SCENE_LAUNCH_1 && note <= LED_SCENE_LAUNCH_5 ? ledRoute(ROUTE_SAME, note)
+            : ledRoute(ROUTE_NONE, 0);
+    }
+
+    static constexpr bool sendsCc(int cc) {
+        return false;
+    }
+};
+
+template <typename Controller, typename Indices>
+struct DispatchTables;
+
+template <typename Controller, int... Is>
+struct DispatchTables<Controller, IndexList<Is...>> {
+    static constexpr ControlEntry noteOn[sizeof...(Is)] = {Controller::noteOn(Is)...};
+    static constexpr ControlEntry noteOff[sizeof...(Is)] = {Controller::noteOff(Is)...};
+    static constexpr ControlEntry cc[sizeof...(Is)] = {Controller::cc(Is)...};
+    static constexpr LedRoute leds[sizeof...(Is)] = {Controller::led(Is)...};
+    static constexpr bool ccs[sizeof...(Is)] = {Controller::sendsCc(Is)...};
+    static constexpr LedColor colors[sizeof...(Is)] = {Controller::color(Is)...};
+};
+
+template <typename Controller, int... Is>
+constexpr ControlEntry DispatchTables<Controller, IndexList<Is...>>::noteOn[sizeof...(Is)];
+template <typename Controller, int... Is>
+constexpr ControlEntry DispatchTables<Controller, IndexList<Is...>>::noteOff[sizeof...(Is)];
+template <typename Controller, int... Is>
+constexpr ControlEntry DispatchTables<Controller, IndexList<Is...>>::cc[sizeof...(Is)];
+template <typename Controller, int... Is>
+constexpr LedRoute DispatchTables<Controller, IndexList<Is...>>::leds[sizeof...(Is)];
+template <typename Controller, int... Is>
+constexpr bool DispatchTables<Controller, IndexList<Is...>>::ccs[sizeof...(Is)];
+template <typename Controller, int... Is>
+constexpr LedColor DispatchTables<Controller, IndexList<Is...>>::colors[sizeof...(Is)];
+
+/** The tables of a controller, indexed by the 7-bit note, CC number or LED value. */
+template <typename Controller>
+struct Dispatch : DispatchTables<Controller, MakeIndexList<128>::type> {};
+
+/** The tables of the connected controller, chosen once from its identity reply, so handling a message never branches on the model. */
+struct ControllerProfile {
+    const char* name;
+    uint8_t modelId;
+    bool introduced;
+    const ControlEntry* noteOn;
+    const ControlEntry* noteOff;
+    const ControlEntry* cc;
+    const LedRoute* leds;
+    const bool* ccs;
+    const LedColor* colors;
+};
+
+template <typename Controller>
+const ControllerProfile& controllerProfile(const char* name) {
+    typedef Dispatch<Controller> D;
+    static const ControllerProfile profile = {
+        name, Controller::MODEL_ID, Controller::INTRODUCED, D::noteOn, D::noteOff, D::cc, D::leds, D::ccs, D::colors
+    };
+    return profile;
+}
+
+/** The profile of the model an identity reply names, the APC40's for unknown models. */
+inline const ControllerProfile& controllerProfile(uint8_t modelId) {
+    switch (modelId) {
+        case Apc40Mk2::MODEL_ID:
+            return controllerProfile<Apc40Mk2>("APC40 mkII");
+        case ApcMini::MODEL_ID:
+            return controllerProfile<ApcMini>("APC mini");
+        default:
+            return controllerProfile<Apc40>("APC40");
+    }
+}
+
+static_assert(Apc40::noteOn(LED_CLIP_LAUNCH_5).control == CONTROL_TRACK_LED && Apc40::noteOn(LED_CLIP_LAUNCH_5).index == CHAN_LED_NUM - 1, "clip launch 5 must be the last track LED");
+static_assert(Apc40::noteOn(LED_SCENE_LAUNCH_3).trigger == TRIGGER_SCENE_3, "scene launch buttons are trigger buttons");
+static_assert(Apc40::noteOff(BTN_TAP_TEMPO).control == CONTROL_NONE, "tap tempo reacts to presses only");
+static_assert(Apc40Mk2::noteOn(0).index == LED_CLIP_LAUNCH_5 - LED_RECORD && Apc40Mk2::led(LED_CLIP_LAUNCH_5).note == 0, "the mkII's bottom pad row is clip launch 5");
+static_assert(ApcMini::noteOn(ApcMini::PADS - 1).index == LED_CLIP_LAUNCH_1 - LED_RECORD && ApcMini::led(LED_CLIP_LAUNCH_1).note == ApcMini::PADS - ApcMini::TRACKS, "the mini's top pad row is clip launch 1");
+static_assert(ApcMini::led(LED_RECORD).note == 0 && ApcMini::noteOn(0).index == 0, "the mini's bottom pad row is record");
+
+} //namespace ptone
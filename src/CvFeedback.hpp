@@ -0,0 +1,48 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace ptone {
+
+/** Quantizes voltages of 0 to 10 V to MIDI values 0 to 127, for CV shown on the controller.
+A value changes only once the voltage is HYSTERESIS steps past the middle to its neighbour,
+so a noisy or slowly moving CV does not flicker between two values.
+*/
+template <int N>
+struct CvQuantizer {
+    static constexpr float HYSTERESIS = 0.5f;
+
+    uint8_t value[N] = {};
+
+    /** Returns true if the channel's value changed. */
+    bool process(int channel, float voltage) {
+        float x = std::min(std::max(voltage * 12.7f, 0.f), 127.f);
+        if (std::fabs(x - value[channel]) < 0.5f + HYSTERESIS) return false;
+        value[channel] = (uint8_t) std::round(x);
+        return true;
+    }
+};
+
+/** Gates of up to 64 channels packed in a word, a channel goes high at 1 V and low again at 0 V like dsp::SchmittTrigger. */
+template <int N>
+struct CvGates {
+    static_assert(N <= 64, "too many channels");
+
+    uint64_t high = 0;
+
+    /** Returns true if the channel's gate changed. */
+    bool process(int channel, float voltage) {
+        uint64_t bit = uint64_t(1) << channel;
+        bool wasHigh = high & bit;
+        if (wasHigh ? voltage > 0.f : voltage < 1.f) return false;
+        high ^= bit;
+        return true;
+    }
+
+    bool isHigh(int channel) const {
+        return (high >> channel) & 1;
+    }
+};
+
+} //namespace ptone
@@ -0,0 +1,182 @@
+#include "DeviceHub.hpp"
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <utility>
+#include "vpc_protocol.hpp"
+
+namespace ptone {
+
+// odr-used, e.g. bound to a reference by std::chrono and std::min
+constexpr int DeviceHub::SENDER_QUEUE;
+constexpr int DeviceHub::SENDER_IDLE_US;
+
+// hubs of the devices modules are connected to, keyed by driver and device id
+static std::map<std::pair<int, int>, DeviceHub*> hubs;
+static std::mutex hubsMutex;
+
+DeviceHub* DeviceHub::acquire(int driverId, int deviceId, Subscriber* subscriber) {
+    std::lock_guard<std::mutex> hubsLock(hubsMutex);
+    DeviceHub*& hub = hubs[std::make_pair(driverId, deviceId)];
+    if (!hub) {
+        hub = new DeviceHub(driverId, deviceId);
+    }
+    std::vector<Subscriber*>* list = new std::vector<Subscriber*>(*hub->subscribers.load());
+    list->push_back(subscriber);
+    hub->replaceSubscribers(list);
+    return hub;
+}
+
+void DeviceHub::release(DeviceHub* hub, Subscriber* subscriber) {
+    std::lock_guard<std::mutex> hubsLock(hubsMutex);
+    std::vector<Subscriber*>* list = new std::vector<Subscriber*>(*hub->subscribers.load());
+    list->erase(std::remove(list->begin(), list->end(), subscriber), list->end());
+    hub->replaceSubscribers(list);
+    if (list->empty()) {
+        hubs.erase(std::make_pair(hub->driverId, hub->deviceId));
+        delete hub;
+    }
+}
+
+void DeviceHub::replaceSubscribers(std::vector<Subscriber*>* list) {
+    std::vector<Subscriber*>* replaced = subscribers.exchange(list);
+    // a fan-out that started before the exchange may still push to the old list's subscribers
+    while (fanningOut.load() > 0) {
+        std::this_thread::yield();
+    }
+    delete replaced;
+}
+
+bool DeviceHub::decode(const rack::midi::Message& msg, DeviceEvent& event) {
+    event.frame = msg.getFrame();
+    if (msg.getSize() >= 14 &&
+            msg.bytes[0] == 0xF0 &&
+            msg.bytes[3] == 0x06 &&
+            msg.bytes[4] == 0x02) {
+        event.status = EVENT_INQUIRY_REPLY;
+        event.channel = 0;
+        // the model
+        event.note = msg.bytes[6];
+        event.value = msg.bytes[13];
+        return true;
+    }
+    if (msg.getSize() != 3) return false;
+    event.status = msg.getStatus();
+    if (event.status != STATUS_NOTE_ON && event.status != STATUS_NOTE_OFF && event.status != STATUS_CC) return false;
+    event.channel = msg.getChannel();
+    event.note = msg.getNote();
+    event.value = msg.getValue();
+    return true;
+}
+
+DeviceHub::DeviceHub(int driverId, int deviceId) : driverId(driverId), deviceId(deviceId), subscribers(new std::vector<Subscriber*>()) {
+    input.setDriverId(driverId);
+    input.setDeviceId(deviceId);
+    output.setDriverId(driverId);
+    output.setDeviceId(deviceId);
+    // messages keep their own channels
+    output.setChannel(-1);
+    sender = std::thread(&DeviceHub::runSender, this);
+}
+
+DeviceHub::~DeviceHub() {
+    {
+        std::lock_guard<std::mutex> lock(senderMutex);
+        senderRunning = false;
+    }
+    senderWake.notify_one();
+    // the sender writes what is left in its ring before it returns
+    sender.join();
+    delete subscribers.load();
+}
+
+void DeviceHub::readInput(int64_t frame) {
+    // counted before the list is loaded, so a replaced list is not deleted under the fan-out
+    fanningOut.fetch_add(1);
+    const std::vector<Subscriber*>& list = *subscribers.load();
+    while (!input.events.empty()) {
+        const DeviceEvent& event = input.events.front();
+        // stamped ahead by the driver, waits for its frame
+        if (event.frame > frame) break;
+        for (Subscriber* subscriber : list) {
+            if (!subscriber->events.push(event)) {
+                subscriber->overflows++;
+            }
+        }
+        input.events.pop();
+    }
+    fanningOut.fetch_sub(1, std::memory_order_release);
+}
+
+void DeviceHub::sendMessage(Subscriber* subscriber, const rack::midi::Message& msg) {
+    if (subscriber->direct.full()) {
+        senderOverflows++;
+        return;
+    }
+    OutboundMessage message;
+    message.frame = msg.getFrame();
+    message.size = std::min((int) msg.getSize(), (int) OutboundMessage::MAX_SIZE);
+    std::copy(msg.bytes.begin(), msg.bytes.begin() + message.size, message.bytes);
+    subscriber->direct.push(message);
+}
+
+void DeviceHub::runSender() {
+    rack::midi::Message msg;
+    while (true) {
+        // read before the ring, so whatever was handed over before stopping is still written
+        bool running = senderRunning;
+        int batch = outbound.size();
+        for (int i = 0; i < batch; i++) {
+            const OutboundMessage& message = outbound.front();
+            msg.setSize(message.size);
+            std::copy(message.bytes, message.bytes + message.size, msg.bytes.begin());
+            msg.setFrame(message.frame);
+            output.sendMessage(msg);
+            // popped once written, so an empty ring means everything reached the driver
+            outbound.pop();
+        }
+        if (!running) break;
+        if (batch > 0) continue;
+        std::unique_lock<std::mutex> lock(senderMutex);
+        senderWaiting = true;
+        if (senderRunning && outbound.empty()) {
+            senderWake.wait_for(lock, std::chrono::microseconds(SENDER_IDLE_US));
+        }
+        senderWaiting = false;
+    }
+}
+
+int DeviceHub::flush(int64_t frame, Subscriber* subscriber, MidiOutQueue<NUM_FLUSH_PRIORITIES>& from, int budget, int periodFrames) {
+    // another engine thread is flushing, this subscriber's messages stay with it until its next flush
+    if (flushing.exchange(true, std::memory_order_acquire)) return 0;
+    int handedOver = 0;
+    while (!subscriber->direct.empty() && outbound.push(subscriber->direct.front())) {
+        subscriber->direct.pop();
+        handedOver++;
+    }
+    from.transfer(outQueue);
+    int sent = 0;
+    if (frame - flushFrame >= periodFrames) {
+        flushFrame = frame;
+        // backpressure, what does not fit stays queued and keeps coalescing
+        budget = std::min(budget, SENDER_QUEUE - outbound.size());
+        sent = outQueue.flush(budget, [&](uint8_t status, uint8_t channel, uint8_t note, uint8_t value) {
+            OutboundMessage message;
+            message.frame = frame;
+            message.size = 3;
+            message.bytes[0] = (status << 4) | channel;
+            message.bytes[1] = note;
+            message.bytes[2] = value;
+            outbound.push(message);
+        });
+    }
+    flushing.store(false, std::memory_order_release);
+    // notified without the sender's mutex and after releasing the flag, so no engine thread waits on it
+    if (handedOver + sent > 0 && senderWaiting.load()) {
+        senderWake.notify_one();
+    }
+    return sent;
+}
+
+} //namespace ptone
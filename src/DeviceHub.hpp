@@ -0,0 +1,153 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <midi.hpp>
+#include "MidiOutQueue.hpp"
+#include "RingQueue.hpp"
+
+// status of a SysEx identity reply event, its note is the model and its value the id to address the device with
+#define EVENT_INQUIRY_REPLY 0x0F
+
+namespace ptone {
+
+/** An inbound message decoded once for every module connected to the device. */
+struct DeviceEvent {
+    int64_t frame;
+    // STATUS_NOTE_ON, STATUS_NOTE_OFF, STATUS_CC or EVENT_INQUIRY_REPLY
+    uint8_t status;
+    uint8_t channel;
+    uint8_t note;
+    uint8_t value;
+};
+
+/** An outbound message handed to the sender thread, fixed-size so queuing it allocates nothing. */
+struct OutboundMessage {
+    static constexpr int MAX_SIZE = 16;
+
+    int64_t frame;
+    uint8_t size;
+    uint8_t bytes[MAX_SIZE];
+};
+
+/** Order in which outbound messages are flushed, ring types before ring values before LEDs. */
+enum FlushPriority {
+    RING_TYPE_PRIORITY,
+    RING_VALUE_PRIORITY,
+    LED_PRIORITY,
+    NUM_FLUSH_PRIORITIES
+};
+
+/** One MIDI device shared by every module connected to it, keyed by driver and device id.
+
+The driver's callback decodes each message once into a ring of events,
+the first subscriber processed in a frame pushes those that are due to every subscriber's ring.
+Subscribers queue outbound messages on their own and hand them over on their flushes.
+The hub merges them in one queue that shadows the device, so a message is only sent if it changes what the device shows,
+and sends at most one budget of messages per flush period for all subscribers together.
+
+Messages are written to the driver by the hub's sender thread, which may block in a driver without stalling the engine.
+The engine hands them over through a lock-free ring and only flushes as many as the ring has room for,
+the rest wait coalescing in the queue.
+
+The engine never takes a lock on a hub. Subscribers are connected and disconnected on the UI thread by replacing the list the engine fans out to,
+and a subscriber flushing while another one does on another engine thread skips its turn, its messages wait in its own queues.
+*/
+struct DeviceHub {
+    struct Subscriber {
+        // pushed by the engine thread fanning out, popped by the subscriber
+        SpscRingQueue<DeviceEvent, 1024> events;
+        // events dropped because the ring was full
+        std::atomic<uint32_t> overflows{0};
+        // messages sent bypassing the queue, e.g. SysEx, handed over on the subscriber's next flush
+        RingQueue<OutboundMessage, 16> direct;
+    };
+
+    /** Decodes messages on the driver's thread, so the engine only fans out ready events and polling a quiet device takes no lock. */
+    struct Input : rack::midi::Input {
+        // pushed by the driver, popped by the engine thread fanning out
+        SpscRingQueue<DeviceEvent, 1024> events;
+        // decoded messages dropped because the ring was full
+        std::atomic<uint32_t> overflows{0};
+
+        void onMessage(const rack::midi::Message& msg) override {
+            DeviceEvent event;
+            if (!decode(msg, event)) return;
+            if (!events.push(event)) {
+                overflows.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    };
+
+    // messages the sender thread has not written yet
+    static constexpr int SENDER_QUEUE = 512;
+    // longest the idle sender waits, in case a flush woke it between its check of the ring and its wait
+    static constexpr int SENDER_IDLE_US = 10000;
+
+    int driverId;
+    int deviceId;
+    Input input;
+    // only used by the sender thread
+    rack::midi::Output output;
+    MidiOutQueue<NUM_FLUSH_PRIORITIES> outQueue;
+    // pushed while flushing, popped by the sender once written
+    SpscRingQueue<OutboundMessage, SENDER_QUEUE> outbound;
+    std::atomic<bool> senderRunning{true};
+    // the sender waits here while its ring is empty, a flush that handed messages over wakes it
+    std::mutex senderMutex;
+    std::condition_variable senderWake;
+    std::atomic<bool> senderWaiting{false};
+    std::thread sender;
+    /** SysEx messages dropped because a subscriber sent more than it could hand over */
+    std::atomic<uint32_t> senderOverflows{0};
+    // held by the one subscriber flushing, guards the queue and the producer side of `outbound`
+    std::atomic<bool> flushing{false};
+    // replaced whole on the UI thread, a replaced list is deleted once no engine thread fans out to it
+    std::atomic<std::vector<Subscriber*>*> subscribers;
+    std::atomic<int> fanningOut{0};
+    // frame the device was last read on, claimed by one subscriber per frame
+    std::atomic<int64_t> polledFrame{-1};
+    int64_t flushFrame = INT64_MIN / 2;
+
+    /** Connects a subscriber to the hub of a device, creating the hub for its first subscriber.
+    Creating one opens the device's ports and starts the sender thread, so this is never called on the engine thread either.
+    */
+    static DeviceHub* acquire(int driverId, int deviceId, Subscriber* subscriber);
+    /** Disconnects a subscriber, the hub is deleted with its last one.
+    Deleting joins the sender thread, which may be blocked in the driver, so this is never called on the engine thread.
+    */
+    static void release(DeviceHub* hub, Subscriber* subscriber);
+    /** Publishes a new list of subscribers, then waits until no engine thread fans out to the old one and deletes it. */
+    void replaceSubscribers(std::vector<Subscriber*>* list);
+    /** Decodes the messages modules react to. Returns false for any other message. */
+    static bool decode(const rack::midi::Message& msg, DeviceEvent& event);
+
+    DeviceHub(int driverId, int deviceId);
+    ~DeviceHub();
+
+    /** Fans out the events due by `frame`, once per frame whichever subscriber calls it first. */
+    void poll(int64_t frame) {
+        if (input.events.empty()) return;
+        int64_t last = polledFrame.load(std::memory_order_relaxed);
+        if (last == frame || !polledFrame.compare_exchange_strong(last, frame)) return;
+        readInput(frame);
+    }
+
+    void readInput(int64_t frame);
+
+    /** Sends a message on the subscriber's next flush, ahead of and bypassing the queue, e.g. SysEx. */
+    void sendMessage(Subscriber* subscriber, const rack::midi::Message& msg);
+
+    /** Writes queued messages to the driver until the hub is deleted, all that are queued at once, and the rest once it is stopped. */
+    void runSender();
+
+    /** Takes over the subscriber's pending messages, then sends up to `budget` queued messages if `periodFrames` passed since the last flush,
+    fewer if the sender is behind. Returns the number of messages sent, 0 if another subscriber is flushing.
+    */
+    int flush(int64_t frame, Subscriber* subscriber, MidiOutQueue<NUM_FLUSH_PRIORITIES>& from, int budget, int periodFrames);
+};
+
+} //namespace ptone
@@ -0,0 +1,105 @@
+#pragma once
+#include <cstdint>
+
+namespace ptone {
+
+/** A fixed-size set of indices packed into 64-bit words.
+Iteration uses count-trailing-zeros, so it only touches members and costs nothing when the set is empty.
+*/
+template <int N>
+struct DirtySet {
+    static constexpr int WORDS = (N + 63) / 64;
+    uint64_t words[WORDS] = {};
+
+    void set(int i) {
+        words[i >> 6] |= uint64_t(1) << (i & 63);
+    }
+
+    void reset(int i) {
+        words[i >> 6] &= ~(uint64_t(1) << (i & 63));
+    }
+
+    bool test(int i) const {
+        return (words[i >> 6] >> (i & 63)) & 1;
+    }
+
+    bool any() const {
+        uint64_t w = 0;
+        for (int j = 0; j < WORDS; j++) {
+            w |= words[j];
+        }
+        return w != 0;
+    }
+
+    int count() const {
+        int n = 0;
+        for (int j = 0; j < WORDS; j++) {
+            n += __builtin_popcountll(words[j]);
+        }
+        return n;
+    }
+
+    void setAll() {
+        for (int i = 0; i < N; i++) {
+            set(i);
+        }
+    }
+
+    void clear() {
+        for (int j = 0; j < WORDS; j++) {
+            words[j] = 0;
+        }
+    }
+
+    /** Adds every member of `other` to the set. */
+    void merge(const DirtySet& other) {
+        for (int j = 0; j < WORDS; j++) {
+            words[j] |= other.words[j];
+        }
+    }
+
+    /** Removes the members that are also in `mask`, calling f(index) for each in ascending order. */
+    template <typename F>
+    void drain(const DirtySet& mask, F f) {
+        for (int j = 0; j < WORDS; j++) {
+            uint64_t w = words[j] & mask.words[j];
+            words[j] &= ~w;
+            while (w) {
+                f(j * 64 + __builtin_ctzll(w));
+                w &= w - 1;
+            }
+        }
+    }
+
+    /** Removes up to `count` of the lowest members, calling f(index) for each in ascending order.
+    Returns the number of members removed.
+    */
+    template <typename F>
+    int drainFirst(int count, F f) {
+        int n = 0;
+        for (int j = 0; j < WORDS && n < count; j++) {
+            while (words[j] && n < count) {
+                int b = __builtin_ctzll(words[j]);
+                words[j] &= words[j] - 1;
+                f(j * 64 + b);
+                n++;
+            }
+        }
+        return n;
+    }
+
+    /** Removes all members, calling f(index) for each in ascending order. */
+    template <typename F>
+    void drain(F f) {
+        for (int j = 0; j < WORDS; j++) {
+            uint64_t w = words[j];
+            words[j] = 0;
+            while (w) {
+                f(j * 64 + __builtin_ctzll(w));
+                w &= w - 1;
+            }
+        }
+    }
+};
+
+} //namespace ptone
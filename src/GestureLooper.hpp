@@ -0,0 +1,256 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+
+namespace ptone {
+
+/** Records the values of LANES lanes with their times and loops them in sync with a clock.
+
+Times count 1/SUBTICKS of a clock tick, interpolated between ticks, so a loop follows tempo changes.
+Each lane is a fixed ring of CAPACITY events holding one pass of the loop ahead of the playhead,
+and each event stores its time as the delta to the event before it.
+A played event moves to the back of its ring for the next pass,
+or is dropped while the lane is overdubbed, so touching a control replaces its lane until the pass ends.
+Nothing is allocated after construction.
+*/
+template <int LANES, int CAPACITY>
+struct GestureLooper {
+    static constexpr int SUBTICKS = 256;
+    // longest loop, deltas are 32 bits
+    static constexpr int64_t MAX_LENGTH = int64_t(1) << 31;
+
+    enum State {
+        EMPTY,
+        // recording starts on the next tick once the tick interval is known
+        ARMED,
+        RECORDING,
+        PLAYING,
+        OVERDUBBING,
+        // paused, resumes on the next tick
+        STOPPED
+    };
+
+    struct Event {
+        uint32_t delta;
+        uint8_t channel;
+        uint8_t value;
+    };
+
+    struct Lane {
+        Event events[CAPACITY];
+        int head = 0;
+        int size = 0;
+        // times of the first and last event
+        int64_t headTime = 0;
+        int64_t tailTime = 0;
+        // events before this time are replaced by the overdub
+        int64_t overdubEnd = 0;
+
+        void push(int64_t time, uint8_t channel, uint8_t value) {
+            Event& event = events[(head + size) % CAPACITY];
+            event.delta = size == 0 ? 0 : time - tailTime;
+            event.channel = channel;
+            event.value = value;
+            if (size == 0) {
+                headTime = time;
+            }
+            tailTime = time;
+            size++;
+        }
+
+        void pop() {
+            head = (head + 1) % CAPACITY;
+            size--;
+            if (size > 0) {
+                headTime += events[head].delta;
+            }
+        }
+    };
+
+    Lane lanes[LANES];
+    State state = EMPTY;
+    // subticks since recording started, the loop's times are unwrapped
+    int64_t position = 0;
+    int64_t tickTime = 0;
+    int64_t length = 0;
+    // end of the current pass
+    int64_t passEnd = 0;
+    // time of the earliest event of any lane
+    int64_t nextTime = INT64_MAX;
+    int framesSinceTick = 0;
+    // 0 until two ticks were seen
+    int framesPerTick = 0;
+    bool tickSeen = false;
+    bool closeRequested = false;
+    /** events dropped because their lane was full */
+    uint32_t overflows = 0;
+
+    bool isCapturing() const {
+        return state == RECORDING || state == OVERDUBBING;
+    }
+
+    /** Arms an empty looper, closes the first pass, or toggles overdubbing. */
+    void record() {
+        switch (state) {
+            case EMPTY:
+                state = ARMED;
+                break;
+            case ARMED:
+                state = EMPTY;
+                break;
+            case RECORDING:
+                closeRequested = true;
+                break;
+            case PLAYING:
+                state = OVERDUBBING;
+                break;
+            case OVERDUBBING:
+                endOverdub();
+                state = PLAYING;
+                break;
+            case STOPPED:
+                break;
+        }
+    }
+
+    /** Closes the first pass, or pauses and resumes playback. */
+    void play() {
+        switch (state) {
+            case ARMED:
+                state = EMPTY;
+                break;
+            case RECORDING:
+                closeRequested = true;
+                break;
+            case PLAYING:
+            case OVERDUBBING:
+                endOverdub();
+                state = STOPPED;
+                break;
+            case STOPPED:
+                // the interval up to the next tick is not a whole one
+                state = PLAYING;
+                framesSinceTick = 0;
+                tickSeen = false;
+                break;
+            case EMPTY:
+                break;
+        }
+    }
+
+    void clear() {
+        for (int l = 0; l < LANES; l++) {
+            lanes[l].head = 0;
+            lanes[l].size = 0;
+            lanes[l].overdubEnd = 0;
+        }
+        state = EMPTY;
+        position = 0;
+        tickTime = 0;
+        length = 0;
+        nextTime = INT64_MAX;
+        framesPerTick = 0;
+        tickSeen = false;
+        closeRequested = false;
+    }
+
+    /** Records a value of a lane at the playhead, for the next pass while overdubbing. */
+    void capture(int lane, uint8_t channel, uint8_t value) {
+        Lane& l = lanes[lane];
+        if (l.size == CAPACITY) {
+            overflows++;
+            return;
+        }
+        if (state == RECORDING) {
+            l.push(position, channel, value);
+        } else if (state == OVERDUBBING) {
+            l.overdubEnd = passEnd;
+            l.push(position + length, channel, value);
+            if (l.size == 1) {
+                nextTime = std::min(nextTime, l.headTime);
+            }
+        }
+    }
+
+    /** Advances by one frame, `tick` on the frames a clock tick falls on, and calls apply(lane, channel, value) for the events due. */
+    template <typename F>
+    void process(bool tick, F apply) {
+        if (state == EMPTY || state == STOPPED) return;
+        framesSinceTick++;
+        if (tick) {
+            processTick();
+        } else if (framesPerTick > 0) {
+            // stays within the tick until the next one arrives
+            int64_t sub = std::min<int64_t>(int64_t(framesSinceTick) * SUBTICKS / framesPerTick, SUBTICKS - 1);
+            // never moves back, e.g. after a pause within a tick
+            position = std::max(position, tickTime + sub);
+        }
+        if (state == PLAYING || state == OVERDUBBING) {
+            while (position >= passEnd) {
+                passEnd += length;
+            }
+            if (position >= nextTime) {
+                playDue(apply);
+            }
+        }
+    }
+
+    void processTick() {
+        if (tickSeen) {
+            framesPerTick = framesSinceTick;
+        }
+        tickSeen = true;
+        framesSinceTick = 0;
+        if (state == ARMED) {
+            if (framesPerTick > 0) {
+                state = RECORDING;
+                position = tickTime = 0;
+            }
+            return;
+        }
+        position = tickTime += SUBTICKS;
+        if (state == RECORDING && (closeRequested || position >= MAX_LENGTH)) {
+            closeRequested = false;
+            // the first pass was recorded from 0, it plays again from here
+            length = position;
+            passEnd = 2 * length;
+            nextTime = INT64_MAX;
+            for (int l = 0; l < LANES; l++) {
+                lanes[l].headTime += length;
+                lanes[l].tailTime += length;
+                if (lanes[l].size > 0) {
+                    nextTime = std::min(nextTime, lanes[l].headTime);
+                }
+            }
+            state = PLAYING;
+        }
+    }
+
+    template <typename F>
+    void playDue(F apply) {
+        nextTime = INT64_MAX;
+        for (int l = 0; l < LANES; l++) {
+            Lane& lane = lanes[l];
+            while (lane.size > 0 && lane.headTime <= position) {
+                Event event = lane.events[lane.head];
+                int64_t time = lane.headTime;
+                lane.pop();
+                if (time < lane.overdubEnd) continue;
+                apply(l, event.channel, event.value);
+                lane.push(time + length, event.channel, event.value);
+            }
+            if (lane.size > 0) {
+                nextTime = std::min(nextTime, lane.headTime);
+            }
+        }
+    }
+
+    // the rest of the pass plays again
+    void endOverdub() {
+        for (int l = 0; l < LANES; l++) {
+            lanes[l].overdubEnd = 0;
+        }
+    }
+};
+
+} //namespace ptone
@@ -0,0 +1,18 @@
+#pragma once
+
+namespace ptone {
+
+// Rack plugins are built as C++11, which has no std::integer_sequence.
+// Compile-time tables are generated by expanding a function over an IndexList<0, ..., N - 1>.
+template <int... Is>
+struct IndexList {};
+
+template <int N, int... Is>
+struct MakeIndexList : MakeIndexList<N - 1, N - 1, Is...> {};
+
+template <int... Is>
+struct MakeIndexList<0, Is...> {
+    typedef IndexList<Is...> type;
+};
+
+} //namespace ptone
@@ -0,0 +1,149 @@
+#pragma once
+#include <midi.hpp>
+#include "DirtySet.hpp"
+#include "vpc_protocol.hpp"
+
+namespace ptone {
+
+/** Outbound MIDI queue that keeps only the latest message per (channel, note or CC).
+Note on and note off share a slot, so an LED switched on and off again before it is sent goes out once with its final state.
+Flushing sends a bounded number of messages, lower priority values first.
+
+The queue also shadows the last message sent in each slot, i.e. what the device currently shows,
+and drops messages that would not change it.
+*/
+template <int PRIORITIES>
+struct MidiOutQueue {
+    // note and CC slots for every channel
+    static constexpr int SLOTS = 2 * 16 * 128;
+
+    uint8_t slotStatus[SLOTS] = {};
+    uint8_t slotValue[SLOTS] = {};
+    DirtySet<SLOTS> pending[PRIORITIES];
+    // last message sent in each slot
+    uint8_t sentStatus[SLOTS] = {};
+    uint8_t sentValue[SLOTS] = {};
+    DirtySet<SLOTS> sentKnown;
+    // forgotten and cancelled slots and invalidation not yet passed on by transfer
+    DirtySet<SLOTS> forgotten;
+    DirtySet<SLOTS> cancelled;
+    bool invalidated = false;
+    /** messages replaced by a newer one before they were sent */
+    uint32_t coalesced = 0;
+    /** messages dropped because the device already shows them */
+    uint32_t suppressed = 0;
+
+    static int slot(uint8_t status, uint8_t channel, uint8_t note) {
+        return ((status == STATUS_CC ? 1 : 0) << 11) | ((channel & 0x0F) << 7) | (note & 0x7F);
+    }
+
+    /** Queues a message. Returns false if the device already shows it. */
+    bool push(int priority, uint8_t status, uint8_t channel, uint8_t note, uint8_t value) {
+        int i = slot(status, channel, note);
+        for (int p = 0; p < PRIORITIES; p++) {
+            if (pending[p].test(i)) {
+                pending[p].reset(i);
+                coalesced++;
+            }
+        }
+        if (sentKnown.test(i) && sentStatus[i] == status && sentValue[i] == value) {
+            suppressed++;
+            return false;
+        }
+        slotStatus[i] = status;
+        slotValue[i] = value;
+        pending[priority].set(i);
+        return true;
+    }
+
+    /** Forgets what the device shows in one slot, so the next message for it is always sent. */
+    void forget(uint8_t status, uint8_t channel, uint8_t note) {
+        int i = slot(status, channel, note);
+        sentKnown.reset(i);
+        forgotten.set(i);
+    }
+
+    /** Drops the slot's pending message and forgets what the device shows in it, e.g. a blink replaced by a steady color. */
+    void cancel(uint8_t status, uint8_t channel, uint8_t note) {
+        int i = slot(status, channel, note);
+        cancelSlot(i);
+        cancelled.set(i);
+    }
+
+    void cancelSlot(int i) {
+        for (int p = 0; p < PRIORITIES; p++) {
+            pending[p].reset(i);
+        }
+        sentKnown.reset(i);
+    }
+
+    /** Forgets what the device shows, e.g. after it was reconnected. */
+    void invalidate() {
+        sentKnown.clear();
+        invalidated = true;
+    }
+
+    bool empty() const {
+        for (int p = 0; p < PRIORITIES; p++) {
+            if (pending[p].any()) return false;
+        }
+        return true;
+    }
+
+    /** Number of queued messages. */
+    int size() const {
+        int n = 0;
+        for (int p = 0; p < PRIORITIES; p++) {
+            n += pending[p].count();
+        }
+        return n;
+    }
+
+    void clear() {
+        for (int p = 0; p < PRIORITIES; p++) {
+            pending[p].clear();
+        }
+    }
+
+    /** Moves the pending messages to `to`, a queue that sends them and shadows the device, e.g. one shared by several modules.
+    Forgetting, cancelling and invalidation since the last transfer are applied to `to` first.
+    Messages that `to` drops because the device already shows them count as suppressed here.
+    */
+    void transfer(MidiOutQueue& to) {
+        if (invalidated) {
+            to.invalidate();
+            invalidated = false;
+        }
+        forgotten.drain([&](int i) {
+            to.sentKnown.reset(i);
+        });
+        // a message cancelled here may have been handed over on an earlier flush and still wait in `to`
+        cancelled.drain([&](int i) {
+            to.cancelSlot(i);
+        });
+        for (int p = 0; p < PRIORITIES; p++) {
+            pending[p].drain([&](int i) {
+                if (!to.push(p, slotStatus[i], (i >> 7) & 0x0F, i & 0x7F, slotValue[i])) {
+                    suppressed++;
+                }
+            });
+        }
+    }
+
+    /** Calls send(status, channel, note, value) for at most `budget` pending messages. Returns the number of messages sent. */
+    template <typename F>
+    int flush(int budget, F send) {
+        int sent = 0;
+        for (int p = 0; p < PRIORITIES && sent < budget; p++) {
+            sent += pending[p].drainFirst(budget - sent, [&](int i) {
+                sentStatus[i] = slotStatus[i];
+                sentValue[i] = slotValue[i];
+                sentKnown.set(i);
+                send(slotStatus[i], (i >> 7) & 0x0F, i & 0x7F, slotValue[i]);
+            });
+        }
+        return sent;
+    }
+};
+
+} //namespace ptone
@@ -0,0 +1,126 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string.hpp>
+
+namespace ptone {
+
+/** Counts of values in power-of-two buckets: bucket 0 holds 0 and bucket b holds [2^(b-1), 2^b), the last one everything above. */
+template <int BUCKETS>
+struct Log2Histogram {
+    uint32_t counts[BUCKETS] = {};
+    uint32_t total = 0;
+    uint64_t sum = 0;
+    uint32_t max = 0;
+
+    static int bucket(uint32_t value) {
+        int b = value == 0 ? 0 : 32 - __builtin_clz(value);
+        return b < BUCKETS ? b : BUCKETS - 1;
+    }
+
+    /** Smallest value above the bucket. */
+    static uint32_t bucketEnd(int b) {
+        return uint32_t(1) << b;
+    }
+
+    void add(uint32_t value) {
+        counts[bucket(value)]++;
+        total++;
+        sum += value;
+        if (value > max) max = value;
+    }
+
+    float mean() const {
+        return total ? float(sum) / total : 0.f;
+    }
+
+    /** An upper bound of the given quantile, the end of its bucket or the maximum. */
+    uint32_t quantile(float q) const {
+        uint64_t rank = uint64_t(q * total);
+        uint64_t seen = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            seen += counts[b];
+            if (seen > rank) return (b == BUCKETS - 1 || bucketEnd(b) > max) ? max : bucketEnd(b);
+        }
+        return max;
+    }
+
+    void clear() {
+        *this = Log2Histogram();
+    }
+};
+
+/** MIDI traffic counters of a module, updated on the engine thread without allocating. */
+struct MidiStats {
+    // frames inbound messages waited between their stamp and being popped
+    Log2Histogram<16> inboundLatency;
+    // messages sent by flushes that sent anything
+    Log2Histogram<8> flushSize;
+    // messages still queued after each flush
+    Log2Histogram<14> outboundBacklog;
+    // delayed messages waiting to be applied, sampled at each flush
+    Log2Histogram<10> delayedDepth;
+    uint64_t inboundMessages = 0;
+    uint64_t outboundMessages = 0;
+    // inbound messages applied early because the delay ring was full
+    uint32_t delayOverflows = 0;
+    // messages the driver decoded while the device's ring was full, since the reset or the device was selected
+    uint32_t deviceRingOverflows = 0;
+    // events dropped while this module's ring was full
+    uint32_t moduleRingOverflows = 0;
+    // messages dropped while the device's sender ring was full, since the reset or the device was selected
+    uint32_t senderOverflows = 0;
+    // messages per second over the last full window
+    float inboundRate = 0.f;
+    float outboundRate = 0.f;
+    uint64_t windowInbound = 0;
+    uint64_t windowOutbound = 0;
+    int64_t windowStart = 0;
+
+    /** Closes the rate window once it is a second long. */
+    void updateRates(int64_t frame, float sampleRate) {
+        int64_t frames = frame - windowStart;
+        if (frames < sampleRate) return;
+        float seconds = frames / sampleRate;
+        inboundRate = (inboundMessages - windowInbound) / seconds;
+        outboundRate = (outboundMessages - windowOutbound) / seconds;
+        windowInbound = inboundMessages;
+        windowOutbound = outboundMessages;
+        windowStart = frame;
+    }
+
+    void clear(int64_t frame) {
+        *this = MidiStats();
+        windowStart = frame;
+    }
+
+    template <int BUCKETS>
+    static void histogramToCsv(std::string& csv, const char* name, const Log2Histogram<BUCKETS>& histogram, float scale) {
+        csv += rack::string::f("%s mean,%g\n%s p99,%g\n%s max,%g\n", name, histogram.mean() * scale, name, histogram.quantile(0.99f) * scale, name, histogram.max * scale);
+        for (int b = 0; b < BUCKETS; b++) {
+            csv += rack::string::f("%s < %g,%u\n", name, Log2Histogram<BUCKETS>::bucketEnd(b) * scale, histogram.counts[b]);
+        }
+    }
+
+    /** Two columns, metric and value, latencies in milliseconds. */
+    std::string toCsv(float sampleRate, uint32_t coalesced, uint32_t suppressed) const {
+        std::string csv = "metric,value\n";
+        csv += rack::string::f("inbound messages,%llu\n", (unsigned long long) inboundMessages);
+        csv += rack::string::f("outbound messages,%llu\n", (unsigned long long) outboundMessages);
+        csv += rack::string::f("inbound messages/s,%g\n", inboundRate);
+        csv += rack::string::f("outbound messages/s,%g\n", outboundRate);
+        csv += rack::string::f("coalesced,%u\n", coalesced);
+        csv += rack::string::f("suppressed,%u\n", suppressed);
+        csv += rack::string::f("delay overflows,%u\n", delayOverflows);
+        csv += rack::string::f("device ring overflows,%u\n", deviceRingOverflows);
+        csv += rack::string::f("module ring overflows,%u\n", moduleRingOverflows);
+        csv += rack::string::f("sender overflows,%u\n", senderOverflows);
+        histogramToCsv(csv, "inbound latency ms", inboundLatency, 1000.f / sampleRate);
+        histogramToCsv(csv, "flush size", flushSize, 1.f);
+        histogramToCsv(csv, "outbound backlog", outboundBacklog, 1.f);
+        histogramToCsv(csv, "delayed depth", delayedDepth, 1.f);
+        return csv;
+    }
+};
+
+} //namespace ptone
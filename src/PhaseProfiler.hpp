@@ -0,0 +1,101 @@
+#pragma once
+// Per-phase timing of Module::process, built only with `make PROFILE=1`.
+// Without VPC40_PROFILE the PROFILE_* macros expand to nothing and this header declares nothing.
+#ifdef VPC40_PROFILE
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <string.hpp>
+
+namespace ptone {
+
+/** Time spent in each of PHASES consecutive phases of a call, over the last WINDOW calls that entered the phase. */
+template <int PHASES, int WINDOW = 16384>
+struct PhaseProfiler {
+    static_assert((WINDOW & (WINDOW - 1)) == 0, "window must be a power of two");
+
+    struct Summary {
+        uint32_t samples;
+        uint32_t min;
+        float mean;
+        uint32_t p99;
+        uint32_t max;
+    };
+
+    // nanoseconds of each call, a ring per phase
+    uint32_t times[PHASES][WINDOW] = {};
+    uint32_t writes[PHASES] = {};
+    uint32_t current[PHASES] = {};
+    uint32_t entered = 0;
+    std::chrono::steady_clock::time_point last;
+
+    void begin() {
+        entered = 0;
+        last = std::chrono::steady_clock::now();
+    }
+
+    /** Adds the time since the previous mark to `phase`. */
+    void mark(int phase) {
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        current[phase] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count();
+        entered |= 1u << phase;
+        last = now;
+    }
+
+    void end() {
+        while (entered) {
+            int phase = __builtin_ctz(entered);
+            entered &= entered - 1;
+            times[phase][writes[phase] & (WINDOW - 1)] = current[phase];
+            writes[phase]++;
+            current[phase] = 0;
+        }
+    }
+
+    /** Sorts a copy of the window, call it from the UI thread. */
+    Summary summarize(int phase) const {
+        uint32_t n = std::min<uint32_t>(writes[phase], WINDOW);
+        Summary summary = {n, 0, 0.f, 0, 0};
+        if (n == 0) return summary;
+        std::vector<uint32_t> sorted(times[phase], times[phase] + n);
+        std::sort(sorted.begin(), sorted.end());
+        uint64_t sum = 0;
+        for (uint32_t t : sorted) {
+            sum += t;
+        }
+        summary.min = sorted.front();
+        summary.mean = float(sum) / n;
+        summary.p99 = sorted[std::min<uint32_t>(n - 1, n * 99 / 100)];
+        summary.max = sorted.back();
+        return summary;
+    }
+
+    std::string toCsv(const char* const* phaseNames) const {
+        std::string csv = "phase,samples,min ns,mean ns,p99 ns,max ns\n";
+        for (int p = 0; p < PHASES; p++) {
+            Summary s = summarize(p);
+            csv += rack::string::f("%s,%u,%u,%.1f,%u,%u\n", phaseNames[p], s.samples, s.min, s.mean, s.p99, s.max);
+        }
+        return csv;
+    }
+
+    void clear() {
+        for (int p = 0; p < PHASES; p++) {
+            writes[p] = 0;
+            current[p] = 0;
+        }
+    }
+};
+
+} //namespace ptone
+
+#define PROFILE_BEGIN(profiler) (profiler).begin()
+#define PROFILE_MARK(profiler, phase) (profiler).mark(phase)
+#define PROFILE_END(profiler) (profiler).end()
+#else
+#define PROFILE_BEGIN(profiler)
+#define PROFILE_MARK(profiler, phase)
+#define PROFILE_END(profiler)
+#endif
@@ -0,0 +1,120 @@
+#pragma once
+#include <simd/Vector.hpp>
+#include <simd/functions.hpp>
+#include <algorithm>
+#include <cmath>
+
+namespace ptone {
+
+/** One-pole smoothing of up to CHANNELS voltages towards their targets, four channels per simd::float_4.
+A group of four channels goes to sleep once all of them reached their targets, so a settled smoother costs nothing.
+A channel can instead ramp linearly, timed by the interval of the messages that move it.
+Target arrays are read four floats at a time and must be padded to a multiple of four.
+Only the groups of the first `channels` channels are moved, those above keep their values until the channels are raised again.
+*/
+template <int CHANNELS>
+struct PolySmoother {
+    static constexpr int GROUPS = (CHANNELS + 3) / 4;
+
+    rack::simd::float_4 value[GROUPS];
+    // volts per frame of ramping channels, 0 for the one-pole glide
+    rack::simd::float_4 slope[GROUPS];
+    uint32_t activeGroups = 0;
+    // groups in use, see setChannels
+    uint32_t groupMask = (1u << GROUPS) - 1;
+    // frame of each channel's last ramp, and the average frames between ramps
+    int64_t rampFrame[CHANNELS];
+    float rampInterval[CHANNELS];
+
+    PolySmoother() {
+        for (int g = 0; g < GROUPS; g++) {
+            value[g] = 0.f;
+            slope[g] = 0.f;
+        }
+        for (int c = 0; c < CHANNELS; c++) {
+            rampFrame[c] = 0;
+            rampInterval[c] = 0.f;
+        }
+    }
+
+    /** Jumps to the targets. */
+    void reset(const float* target) {
+        for (int g = 0; g < GROUPS; g++) {
+            value[g] = rack::simd::float_4::load(target + 4 * g);
+        }
+        activeGroups = 0;
+    }
+
+    void wake(int channel) {
+        slope[channel / 4][channel % 4] = 0.f;
+        activeGroups |= (1u << (channel / 4)) & groupMask;
+    }
+
+    void wakeAll() {
+        for (int g = 0; g < GROUPS; g++) {
+            slope[g] = 0.f;
+        }
+        activeGroups = groupMask;
+    }
+
+    /** Limits smoothing to the first `channels` channels, groups coming back into use catch up with their targets. */
+    void setChannels(int channels) {
+        uint32_t mask = (1u << ((channels + 3) / 4)) - 1;
+        uint32_t added = mask & ~groupMask;
+        for (int g = 0; g < GROUPS; g++) {
+            if ((added >> g) & 1) {
+                slope[g] = 0.f;
+            }
+        }
+        groupMask = mask;
+        activeGroups = (activeGroups | added) & mask;
+    }
+
+    /** Ramps the channel to `target` so that it arrives when the next ramp is expected.
+    The interval is averaged over the ramps of a gesture and clamped to [minFrames, maxFrames], a longer pause starts a new gesture.
+    */
+    void ramp(int channel, float target, int64_t frame, float minFrames, float maxFrames) {
+        float interval = frame - rampFrame[channel];
+        rampFrame[channel] = frame;
+        if (interval > maxFrames) {
+            rampInterval[channel] = minFrames;
+        } else {
+            rampInterval[channel] += (std::max(interval, minFrames) - rampInterval[channel]) * 0.25f;
+        }
+        float frames = std::max(rampInterval[channel], minFrames);
+        // a slope of 0 would glide, the smallest one jumps
+        slope[channel / 4][channel % 4] = std::max(std::fabs(target - getValue(channel)) / frames, 1e-9f);
+        activeGroups |= (1u << (channel / 4)) & groupMask;
+    }
+
+    bool isActive() const {
+        return activeGroups != 0;
+    }
+
+    float getValue(int channel) const {
+        return value[channel / 4][channel % 4];
+    }
+
+    /** Moves the awake groups towards the targets by `lambda` (1 jumps), or along their ramps, and calls f(group, value) for each. */
+    template <typename F>
+    void process(const float* target, float lambda, F f) {
+        uint32_t groups = activeGroups;
+        while (groups) {
+            int g = __builtin_ctz(groups);
+            groups &= groups - 1;
+            rack::simd::float_4 t = rack::simd::float_4::load(target + 4 * g);
+            rack::simd::float_4 d = t - value[g];
+            rack::simd::float_4 v = value[g] + rack::simd::ifelse(slope[g] > 0.f, rack::simd::clamp(d, -slope[g], slope[g]), d * lambda);
+            // settle once every channel is within a millivolt, or too close to move at float precision
+            rack::simd::float_4 settled = (rack::simd::fabs(t - v) <= 1e-3f) | (v == value[g]);
+            if (rack::simd::movemask(settled) == 0xF) {
+                v = t;
+                activeGroups &= ~(1u << g);
+            }
+            value[g] = v;
+            f(g, v);
+        }
+    }
+};
+
+} //namespace ptone
@@ -0,0 +1,74 @@
+#pragma once
+#include <simd/Vector.hpp>
+#include <simd/functions.hpp>
+#include <algorithm>
+
+namespace ptone {
+
+/** Trigger pulses on up to CHANNELS channels, four per simd::float_4.
+Pulses are timed in frames relative to the frame they were triggered for, which may be in the past or the future.
+A group of four channels goes to sleep once its pulses ended, so idle pulses cost nothing.
+*/
+template <int CHANNELS>
+struct PulseBank {
+    static constexpr int GROUPS = (CHANNELS + 3) / 4;
+
+    // frames until the pulse starts
+    rack::simd::float_4 delay[GROUPS];
+    // frames the pulse stays high once started
+    rack::simd::float_4 remaining[GROUPS];
+    uint32_t activeGroups = 0;
+
+    PulseBank() {
+        reset();
+    }
+
+    void reset() {
+        for (int g = 0; g < GROUPS; g++) {
+            delay[g] = 0.f;
+            remaining[g] = 0.f;
+        }
+        activeGroups = 0;
+    }
+
+    /** Starts a pulse of `length` frames `offset` frames from now.
+    A pulse for a past frame is shortened by the frames it is late, but lasts at least one frame.
+    */
+    void trigger(int channel, float length, float offset) {
+        int g = channel / 4;
+        int i = channel % 4;
+        if (offset >= 0.f) {
+            delay[g][i] = offset;
+            remaining[g][i] = std::max(remaining[g][i], length);
+        } else {
+            delay[g][i] = 0.f;
+            remaining[g][i] = std::max(remaining[g][i], std::max(1.f, length + offset));
+        }
+        activeGroups |= 1u << g;
+    }
+
+    bool isActive() const {
+        return activeGroups != 0;
+    }
+
+    /** Advances the awake groups by one frame and calls f(group, voltage) with 10 V on the high channels. */
+    template <typename F>
+    void process(F f) {
+        uint32_t groups = activeGroups;
+        while (groups) {
+            int g = __builtin_ctz(groups);
+            groups &= groups - 1;
+            rack::simd::float_4 started = delay[g] <= 0.f;
+            rack::simd::float_4 high = started & (remaining[g] > 0.f);
+            remaining[g] = rack::simd::ifelse(high, remaining[g] - 1.f, remaining[g]);
+            delay[g] = rack::simd::ifelse(started, delay[g], delay[g] - 1.f);
+            f(g, rack::simd::ifelse(high, 10.f, 0.f));
+            // the group has written its last low frame
+            if (rack::simd::movemask(high | (remaining[g] > 0.f)) == 0) {
+                activeGroups &= ~(1u << g);
+            }
+        }
+    }
+};
+
+} //namespace ptone
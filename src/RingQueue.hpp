@@ -0,0 +1,88 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+namespace ptone {
+
+/** A fixed-capacity FIFO for a single thread, its items are allocated once with the queue. */
+template <typename T, int N>
+struct RingQueue {
+    static_assert((N & (N - 1)) == 0, "capacity must be a power of two");
+
+    T items[N];
+    uint32_t head = 0;
+    uint32_t tail = 0;
+
+    bool empty() const {
+        return head == tail;
+    }
+
+    bool full() const {
+        return tail - head == N;
+    }
+
+    int size() const {
+        return tail - head;
+    }
+
+    void push(const T& item) {
+        items[tail & (N - 1)] = item;
+        tail++;
+    }
+
+    T& front() {
+        return items[head & (N - 1)];
+    }
+
+    void pop() {
+        head++;
+    }
+
+    void clear() {
+        head = tail;
+    }
+};
+
+/** A fixed-capacity lock-free FIFO between one producer thread and one consumer thread.
+Several producers may take turns if something else orders them, e.g. a flag only one of them holds at a time.
+*/
+template <typename T, int N>
+struct SpscRingQueue {
+    static_assert((N & (N - 1)) == 0, "capacity must be a power of two");
+
+    T items[N];
+    std::atomic<uint32_t> head{0};
+    std::atomic<uint32_t> tail{0};
+
+    /** Producer side. Returns false and drops the item if the queue is full. */
+    bool push(const T& item) {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == N) return false;
+        items[t & (N - 1)] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Consumer side. */
+    bool empty() const {
+        return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire);
+    }
+
+    int size() const {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_relaxed);
+    }
+
+    T& front() {
+        return items[head.load(std::memory_order_relaxed) & (N - 1)];
+    }
+
+    void pop() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    void clear() {
+        head.store(tail.load(std::memory_order_acquire), std::memory_order_release);
+    }
+};
+
+} //namespace ptone
@@ -0,0 +1,79 @@
+#pragma once
+#include <simd/Vector.hpp>
+#include <cstdint>
+
+namespace ptone {
+
+/** SNAPSHOTS stored sets of N voltages and a morph between two of them, a and b, by a position of 0 to 1.
+The morph is only computed when the position or a selected snapshot changed, four voltages per simd::float_4.
+*/
+template <int N, int SNAPSHOTS>
+struct SnapshotMorph {
+    static_assert(N % 4 == 0, "voltages are morphed four at a time");
+    static constexpr int GROUPS = N / 4;
+
+    float voltage[SNAPSHOTS][N] = {};
+    uint32_t storedMask = 0;
+    // selected snapshots, -1 for none
+    int a = -1;
+    int b = -1;
+    float position = 0.f;
+    // the morph has to be computed again
+    bool changed = false;
+
+    bool isStored(int snapshot) const {
+        return (storedMask >> snapshot) & 1;
+    }
+
+    bool isActive() const {
+        return a >= 0 && b >= 0;
+    }
+
+    void store(int snapshot, const float* source, int offset, int count) {
+        for (int i = 0; i < count; i++) {
+            voltage[snapshot][offset + i] = source[i];
+        }
+        storedMask |= 1u << snapshot;
+        changed |= snapshot == a || snapshot == b;
+    }
+
+    /** Selects a stored snapshot on the side the position is away from, so the morph heads towards it. */
+    void select(int snapshot) {
+        if (!isStored(snapshot)) return;
+        if (position < 0.5f) {
+            b = snapshot;
+        } else {
+            a = snapshot;
+        }
+        changed = true;
+    }
+
+    void setPosition(float newPosition) {
+        if (newPosition == position) return;
+        position = newPosition;
+        changed = true;
+    }
+
+    void clear() {
+        storedMask = 0;
+        a = -1;
+        b = -1;
+        changed = false;
+    }
+
+    /** Computes the morph if anything changed and calls f(i, v) for the four voltages from index i. Returns true if it did. */
+    template <typename F>
+    bool process(F f) {
+        if (!changed || !isActive()) return false;
+        changed = false;
+        rack::simd::float_4 x = position;
+        for (int g = 0; g < GROUPS; g++) {
+            rack::simd::float_4 va = rack::simd::float_4::load(&voltage[a][4 * g]);
+            rack::simd::float_4 vb = rack::simd::float_4::load(&voltage[b][4 * g]);
+            f(4 * g, va + (vb - va) * x);
+        }
+        return true;
+    }
+};
+
+} //namespace ptone
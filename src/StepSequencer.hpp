@@ -0,0 +1,54 @@
+#pragma once
+#include <cstdint>
+
+namespace ptone {
+
+/** Gate patterns edited on a grid of ROWS tracks by STEPS_PER_PAGE steps, with PAGES pages of steps.
+Each track is a bit mask of its steps, so the storage is fixed and a step lookup is a shift.
+*/
+template <int ROWS, int STEPS_PER_PAGE, int PAGES>
+struct StepSequencer {
+    static constexpr int MAX_STEPS = STEPS_PER_PAGE * PAGES;
+    static_assert(MAX_STEPS <= 64, "steps of a track must fit in one word");
+
+    uint64_t pattern[ROWS] = {};
+    int length = 2 * STEPS_PER_PAGE;
+    // -1 until the first clock after a reset
+    int step = -1;
+
+    bool get(int row, int s) const {
+        return (pattern[row] >> s) & 1;
+    }
+
+    void toggle(int row, int s) {
+        pattern[row] ^= uint64_t(1) << s;
+    }
+
+    void setLength(int newLength) {
+        length = newLength < 1 ? 1 : newLength > MAX_STEPS ? MAX_STEPS : newLength;
+    }
+
+    /** Moves the playhead to the next step and returns it. */
+    int advance() {
+        step = (step + 1 >= length) ? 0 : step + 1;
+        return step;
+    }
+
+    void rewind() {
+        step = -1;
+    }
+
+    /** Whether the track plays a gate at the playhead. */
+    bool isGate(int row) const {
+        return step >= 0 && get(row, step);
+    }
+
+    void clear() {
+        for (int r = 0; r < ROWS; r++) {
+            pattern[r] = 0;
+        }
+        step = -1;
+    }
+};
+
+} //namespace ptone
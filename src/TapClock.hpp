@@ -0,0 +1,119 @@
+#pragma once
+#include <cstdint>
+
+namespace ptone {
+
+/** A clock whose tempo and phase are set by tapping.
+Taps carry the frame they were received on, so the tempo is measured between taps rather than between engine blocks,
+and the clock is aligned to the tap even if it is handled a few frames later.
+*/
+struct TapClock {
+    static constexpr int TAPS = 4;
+
+    float sampleRate = 48000.f;
+    float bpm = 120.f;
+    // ticks per beat
+    int ppqn = 1;
+    // relative rate offset while nudged, the phase stays shifted when it goes back to 0
+    float nudge = 0.f;
+    bool running = false;
+
+    // position within the current tick, a tick falls on the frame it reaches 1
+    double phase = 0.0;
+    double ticksPerFrame = 0.0;
+    int tickInBeat = 0;
+    // frame of the last process() call
+    int64_t frame = 0;
+
+    int64_t lastTapFrame = -1;
+    int64_t tapIntervals[TAPS] = {};
+    int tapCount = 0;
+
+    TapClock() {
+        updateRate();
+    }
+
+    void setSampleRate(float newSampleRate) {
+        sampleRate = newSampleRate;
+        updateRate();
+    }
+
+    void setBpm(float newBpm) {
+        bpm = newBpm;
+        updateRate();
+    }
+
+    void setPpqn(int newPpqn) {
+        ppqn = newPpqn;
+        tickInBeat = 0;
+        updateRate();
+    }
+
+    void updateRate() {
+        ticksPerFrame = bpm / 60.0 * ppqn / sampleRate;
+    }
+
+    /** Advances to the given frame and returns whether a tick falls on it. */
+    bool process(int64_t newFrame) {
+        frame = newFrame;
+        if (!running) return false;
+        phase += ticksPerFrame * (1.f + nudge);
+        // tolerance for the rounding of the summed increments, so ticks land on exact frame counts
+        if (phase < 1.0 - 1e-9) return false;
+        phase -= 1.0;
+        tickInBeat = (tickInBeat + 1 >= ppqn) ? 0 : tickInBeat + 1;
+        return true;
+    }
+
+    enum TapResult {
+        // the tap only moved the phase
+        TAP_ALIGNED,
+        // the tap came before the beat it stands for, which must tick now
+        TAP_TICK,
+        // the clock started over from the tap
+        TAP_RESTART
+    };
+
+    /** Handles a tap received on tapFrame, before process() is called for the current frame. */
+    TapResult tap(int64_t tapFrame) {
+        int64_t interval = tapFrame - lastTapFrame;
+        // taps slower than 30 BPM start a new tempo, taps faster than 300 BPM are contact bounce
+        bool restart = !running || lastTapFrame < 0 || interval > 2 * sampleRate;
+        if (!restart && interval < 0.2f * sampleRate) return TAP_ALIGNED;
+        lastTapFrame = tapFrame;
+
+        bool tick = restart;
+        if (restart) {
+            tapCount = 0;
+        } else {
+            tapIntervals[tapCount % TAPS] = interval;
+            tapCount++;
+            int n = tapCount < TAPS ? tapCount : TAPS;
+            int64_t sum = 0;
+            for (int i = 0; i < n; i++) {
+                sum += tapIntervals[i];
+            }
+            setBpm(60.f * sampleRate * n / sum);
+            // a tap in the second half of a beat is early for the next one
+            tick = (tickInBeat + phase) / ppqn >= 0.5;
+        }
+        // the beat starts on the tap frame, process() adds the current frame
+        double position = (frame - tapFrame) * ticksPerFrame;
+        if (tick) {
+            tickInBeat = 0;
+            phase = position;
+        } else {
+            // the ticks of this beat that already fired are not repeated
+            phase = position - tickInBeat;
+        }
+        running = true;
+        return restart ? TAP_RESTART : tick ? TAP_TICK : TAP_ALIGNED;
+    }
+
+    void stop() {
+        running = false;
+        lastTapFrame = -1;
+    }
+};
+
+} //namespace ptone
@@ -0,0 +1,93 @@
+#pragma once
+#include <simd/Vector.hpp>
+#include <simd/functions.hpp>
+#include <cstdint>
+
+namespace ptone {
+
+/** Mixes TRACKS mono signals to a main and a cue bus, four tracks per simd::float_4.
+Gains glide towards their targets by `lambda` each frame, so moving a fader does not click.
+A group of four tracks is skipped while none of its inputs is connected, or while all of its gains are settled at 0.
+*/
+template <int TRACKS>
+struct TrackMixer {
+    static_assert(TRACKS % 4 == 0, "tracks are mixed four at a time");
+    static constexpr int GROUPS = TRACKS / 4;
+
+    rack::simd::float_4 gain[GROUPS];
+    rack::simd::float_4 cueGain[GROUPS];
+    rack::simd::float_4 gainTarget[GROUPS];
+    rack::simd::float_4 cueGainTarget[GROUPS];
+    float lambda = 1.f;
+    // groups with a connected input
+    uint32_t connectedGroups = 0;
+    // groups whose gains are gliding, and groups with a gain above 0
+    uint32_t movingGroups = 0;
+    uint32_t audibleGroups = 0;
+
+    TrackMixer() {
+        for (int g = 0; g < GROUPS; g++) {
+            gain[g] = 0.f;
+            cueGain[g] = 0.f;
+            gainTarget[g] = 0.f;
+            cueGainTarget[g] = 0.f;
+        }
+    }
+
+    bool isActive() const {
+        return connectedGroups & (movingGroups | audibleGroups);
+    }
+
+    /** Sets the gains of every track to the main and the cue bus, groups whose targets changed start gliding. */
+    void setTargets(const float* gains, const float* cueGains) {
+        for (int g = 0; g < GROUPS; g++) {
+            rack::simd::float_4 t = rack::simd::float_4::load(gains + 4 * g);
+            rack::simd::float_4 c = rack::simd::float_4::load(cueGains + 4 * g);
+            if (rack::simd::movemask((t != gainTarget[g]) | (c != cueGainTarget[g])) == 0) continue;
+            gainTarget[g] = t;
+            cueGainTarget[g] = c;
+            movingGroups |= 1u << g;
+        }
+    }
+
+    /** Mixes one frame of `in`, four tracks at a time, into `main` and `cue`. */
+    void process(const float* in, float& main, float& cue) {
+        rack::simd::float_4 mainSum = 0.f;
+        rack::simd::float_4 cueSum = 0.f;
+        uint32_t groups = connectedGroups & (movingGroups | audibleGroups);
+        while (groups) {
+            int g = __builtin_ctz(groups);
+            groups &= groups - 1;
+            if ((movingGroups >> g) & 1) {
+                glide(g);
+            }
+            rack::simd::float_4 x = rack::simd::float_4::load(in + 4 * g);
+            mainSum += x * gain[g];
+            cueSum += x * cueGain[g];
+        }
+        main = mainSum[0] + mainSum[1] + mainSum[2] + mainSum[3];
+        cue = cueSum[0] + cueSum[1] + cueSum[2] + cueSum[3];
+    }
+
+    void glide(int g) {
+        rack::simd::float_4 v = gain[g] + (gainTarget[g] - gain[g]) * lambda;
+        rack::simd::float_4 c = cueGain[g] + (cueGainTarget[g] - cueGain[g]) * lambda;
+        // settle within -100 dB, or once too close to move at float precision
+        rack::simd::float_4 settled = ((rack::simd::fabs(gainTarget[g] - v) <= 1e-5f) | (v == gain[g]))
+            & ((rack::simd::fabs(cueGainTarget[g] - c) <= 1e-5f) | (c == cueGain[g]));
+        if (rack::simd::movemask(settled) == 0xF) {
+            v = gainTarget[g];
+            c = cueGainTarget[g];
+            movingGroups &= ~(1u << g);
+            if (rack::simd::movemask((v != 0.f) | (c != 0.f))) {
+                audibleGroups |= 1u << g;
+            } else {
+                audibleGroups &= ~(1u << g);
+            }
+        }
+        gain[g] = v;
+        cueGain[g] = c;
+    }
+};
+
+} //namespace ptone
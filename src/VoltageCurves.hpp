@@ -0,0 +1,70 @@
+#pragma once
+#include <cstdint>
+#include "IndexList.hpp"
+
+namespace ptone {
+
+/** Response curves mapping a 7-bit MIDI value to an output voltage. */
+enum VoltageCurve {
+    // 0 V to 10 V
+    CURVE_LINEAR,
+    // -5 V to 5 V, 64 is 0 V
+    CURVE_BIPOLAR,
+    // 0 V to 10 V, 1 V at the midpoint like an audio taper potentiometer
+    CURVE_AUDIO,
+    // 1 V/oct, one semitone per step, 60 (C4) is 0 V
+    CURVE_SEMITONE,
+    NUM_CURVES
+};
+
+// Rack plugins are built as C++11, so the tables are generated from an index pack and single-expression constexpr functions.
+namespace curves {
+
+constexpr double exp(double x, double sum = 1.0, double term = 1.0, int n = 1) {
+    // Taylor series, converged for the arguments used below
+    return n > 40 ? sum : exp(x, sum + term * x / n, term * x / n, n + 1);
+}
+
+// ln(81), so that 81^x - 1 scaled to 10 V passes 1 V at x = 0.5
+constexpr double AUDIO_K = 4.394449154672439;
+
+constexpr float voltage(int curve, int value) {
+    return curve == CURVE_LINEAR ? 10.0 * value / 127.0
+        : curve == CURVE_BIPOLAR ? (value <= 64 ? -5.0 + 5.0 * value / 64.0 : 5.0 * (value - 64) / 63.0)
+        : curve == CURVE_AUDIO ? 10.0 * (exp(AUDIO_K * value / 127.0) - 1.0) / 80.0
+        : curve == CURVE_SEMITONE ? (value - 60) / 12.0
+        : 0.0;
+}
+
+template <int Curve, typename Indices>
+struct Table;
+
+template <int Curve, int... Is>
+struct Table<Curve, IndexList<Is...>> {
+    static constexpr float values[sizeof...(Is)] = {voltage(Curve, Is)...};
+};
+
+template <int Curve, int... Is>
+constexpr float Table<Curve, IndexList<Is...>>::values[sizeof...(Is)];
+
+template <int Curve>
+struct MidiTable : Table<Curve, MakeIndexList<128>::type> {};
+
+static_assert(voltage(CURVE_LINEAR, 127) == 10.f, "linear curve must end at 10 V");
+static_assert(voltage(CURVE_BIPOLAR, 64) == 0.f, "bipolar curve must be centered at 64");
+static_assert(voltage(CURVE_AUDIO, 127) > 9.999f && voltage(CURVE_AUDIO, 127) < 10.001f, "audio curve must end at 10 V");
+
+} //namespace curves
+
+/** Converts a MIDI value with the given curve, a single table load. */
+inline float midiToVoltage(int curve, uint8_t value) {
+    static const float* const tables[NUM_CURVES] = {
+        curves::MidiTable<CURVE_LINEAR>::values,
+        curves::MidiTable<CURVE_BIPOLAR>::values,
+        curves::MidiTable<CURVE_AUDIO>::values,
+        curves::MidiTable<CURVE_SEMITONE>::values,
+    };
+    return tables[curve][value & 0x7F];
+}
+
+} //namespace ptone
@@ -1,6 +1,24 @@
 #include "plugin.hpp"
 #include "VpcMidiDisplay.hpp"
+#include "ControllerTraits.hpp"
+#include "CvFeedback.hpp"
+#include "DeviceHub.hpp"
+#include "DirtySet.hpp"
+#include "GestureLooper.hpp"
+#include "MidiOutQueue.hpp"
+#include "MidiStats.hpp"
+#include "PhaseProfiler.hpp"
+#include "PolySmoother.hpp"
+#include "PulseBank.hpp"
+#include "RingQueue.hpp"
+#include "SnapshotMorph.hpp"
+#include "StepSequencer.hpp"
+#include "TapClock.hpp"
+#include "TrackMixer.hpp"
+#include "Vpc40Expander.hpp"
+#include "VoltageCurves.hpp"
 #include "vpc_protocol.hpp"
+#include <osdialog.h>
 
 using namespace rack::midi;
 
@@ -11,6 +29,59 @@ struct VpcMidiDin : ptone::MidiButton {
 	}
 };
 
+#define KNOB_GROUP_SIZE (PORT_MAX_CHANNELS * C_KNOB_NUM)
+// clip-launch rows are sequencer tracks, scene buttons select pages of one step per track column
+#define SEQ_ROWS (LED_CLIP_LAUNCH_5 - LED_CLIP_LAUNCH_1 + 1)
+#define SEQ_PAGES (LED_SCENE_LAUNCH_5 - LED_SCENE_LAUNCH_1 + 1)
+// knob voltages of all banks stored by shift+scene launch, the crossfader morphs between two of them
+#define MORPH_SNAPSHOTS (LED_SCENE_LAUNCH_5 - LED_SCENE_LAUNCH_1 + 1)
+// events per looper lane, about 40 s of a knob turned without a pause
+#define LOOP_CAPACITY 2048
+// tempo offset while a nudge button is held
+#define CLOCK_NUDGE 0.04f
+// glide time of the mixer gains
+#define MIXER_SMOOTHING_TIME 0.005f
+
+// state of one row of knobs across all banks, keyed by knobIndex
+struct KnobGroup {
+    uint8_t valueCc;
+    uint8_t ringTypeCc;
+    int firstOutputId;
+    int outputGroup;
+    // polyphonic input whose channels are shown on the rings instead of the knob values
+    int ringInputId;
+
+    float voltage[KNOB_GROUP_SIZE];
+    uint8_t midi[KNOB_GROUP_SIZE];
+    uint8_t ringType[KNOB_GROUP_SIZE];
+    // values and ring types to be sent to the device
+    ptone::DirtySet<KNOB_GROUP_SIZE> valueUpdate;
+    ptone::DirtySet<KNOB_GROUP_SIZE> ringTypeUpdate;
+    // output voltages of each knob, moving towards voltage
+    ptone::PolySmoother<PORT_MAX_CHANNELS> smoothers[C_KNOB_NUM];
+    // ring values set by the input, and the knobs whose ring follows it
+    ptone::CvQuantizer<C_KNOB_NUM> ringCv;
+    uint8_t ringCvMask = 0;
+
+    KnobGroup(uint8_t valueCc, uint8_t ringTypeCc, int firstOutputId, int outputGroup, int ringInputId)
+        : valueCc(valueCc), ringTypeCc(ringTypeCc), firstOutputId(firstOutputId), outputGroup(outputGroup), ringInputId(ringInputId) {
+        reset();
+    }
+
+    void reset() {
+        for (int ki = 0; ki < KNOB_GROUP_SIZE; ki++) {
+            voltage[ki] = 0.f;
+            midi[ki] = 0;
+            ringType[ki] = RING_TYPE_SINGLE;
+        }
+        valueUpdate.setAll();
+        ringTypeUpdate.setAll();
+        for (int k = 0; k < C_KNOB_NUM; k++) {
+            smoothers[k].wakeAll();
+        }
+    }
+};
+
 struct Vpc40Module : Module {
     enum ParamIds {
         RESET_PARAM,
@@ -18,6 +89,23 @@ struct Vpc40Module : Module {
         NUM_PARAMS
     };
     enum InputIds {
+        CLOCK_INPUT,
+        SEQ_RESET_INPUT,
+        DEVICE_RING_INPUT,
+        TRACK_RING_INPUT,
+        CLIP_ROW_1_INPUT,
+        CLIP_ROW_2_INPUT,
+        CLIP_ROW_3_INPUT,
+        CLIP_ROW_4_INPUT,
+        CLIP_ROW_5_INPUT,
+        TRACK_AUDIO_1_INPUT,
+        TRACK_AUDIO_2_INPUT,
+        TRACK_AUDIO_3_INPUT,
+        TRACK_AUDIO_4_INPUT,
+        TRACK_AUDIO_5_INPUT,
+        TRACK_AUDIO_6_INPUT,
+        TRACK_AUDIO_7_INPUT,
+        TRACK_AUDIO_8_INPUT,
         NUM_INPUTS
     };
     enum OutputIds {
@@ -56,6 +144,13 @@ struct Vpc40Module : Module {
         LED_OUTPUT_6,
         LED_OUTPUT_7,
         LED_OUTPUT_8,
+        SEQ_GATE_OUTPUT,
+        CLOCK_OUTPUT,
+        CLOCK_RESET_OUTPUT,
+        BUTTON_TRIGGER_OUTPUT,
+        BUTTON_GATE_OUTPUT,
+        MIX_OUTPUT,
+        CUE_MIX_OUTPUT,
         NUM_OUTPUTS
     };
     enum LightIds {
@@ -63,47 +158,177 @@ struct Vpc40Module : Module {
         TEST_LIGHT,
         NUM_LIGHTS
     };
+    enum OutputGroups {
+        DEVICE_KNOB_GROUP,
+        TRACK_KNOB_GROUP,
+        TRACK_LEVEL_GROUP,
+        MASTER_GROUP,
+        NUM_OUTPUT_GROUPS
+    };
+    // side of the crossfader a track plays on, through plays regardless of it
+    enum CrossfadeSides {
+        XFADE_THRU,
+        XFADE_A,
+        XFADE_B,
+        NUM_XFADE_SIDES
+    };
 
-    InputQueue midiInput;
+    // the selected device, its messages are read and sent through the DeviceHub shared by every module using it
+    rack::midi::Input midiInput;
     rack::midi::Output midiOutput;
     ptone::IoPort ioPort;
+    // hub and subscriber the engine uses
+    ptone::DeviceHub* hub = NULL;
+    // a new hub gets the other subscriber, the old hub may push to its own until it is released
+    ptone::DeviceHub::Subscriber hubSubscribers[2];
+    ptone::DeviceHub::Subscriber* hubSubscriber = &hubSubscribers[0];
+    // hubs are acquired and released on the UI thread, see updateHub, which publishes the next one to the engine.
+    // The engine switches on its next flush and clears the flag, then the hub it used before is released.
+    std::atomic<bool> hubSwitchRequested{false};
+    ptone::DeviceHub* nextHub = NULL;
+    ptone::DeviceHub::Subscriber* nextHubSubscriber = &hubSubscribers[0];
+    ptone::DeviceHub* retiredHub = NULL;
+    ptone::DeviceHub::Subscriber* retiredSubscriber = NULL;
+    // device the next hub was acquired for
+    int hubDriverId = -1;
+    int hubDeviceId = -1;
+    // channel messages waiting for their frame plus the inbound latency
+    ptone::RingQueue<ptone::DeviceEvent, 256> delayedMidi;
+    // inbound messages are applied this long after their frame, 0 applies them when popped
+    float inboundLatency = 0.f;
+    int inboundLatencyFrames = 0;
+    // fader and knob outputs ramp between messages at the rate they arrive
+    bool jitterCompensation = false;
+    // frame of the message being applied
+    int64_t messageFrame = 0;
+    ptone::MidiStats stats;
+    bool statsResetRequested = false;
+    // the hub's overflow counts at the last reset or hub change, the hub counts for every module using it
+    uint32_t deviceRingOverflowBase = 0;
+    uint32_t senderOverflowBase = 0;
+#ifdef VPC40_PROFILE
+    enum ProfilePhase {
+        PROFILE_DRAIN,
+        PROFILE_DISPATCH,
+        PROFILE_CLOCK,
+        PROFILE_FLUSH,
+        PROFILE_OUTPUTS,
+        PROFILE_MIXER,
+        NUM_PROFILE_PHASES
+    };
+    // shown in the menu and exported, one per phase
+    static const char* const PROFILE_PHASE_NAMES[];
+    ptone::PhaseProfiler<NUM_PROFILE_PHASES> profiler;
+    bool profilerResetRequested = false;
+#endif
     dsp::BooleanTrigger resetButtonTrigger;
     dsp::BooleanTrigger testButtonTrigger;
-    dsp::Timer rateLimitTimer;
-    float rateLimitPeriod = 1 / 200.f;
+    // outbound updates are sent at this rate
+    float flushRate = 200.f;
+    int flushPeriodFrames = 48000 / 200;
+    int flushCountdown = 0;
+    // messages sent per flush, the APC40 drops messages when flooded
+    int flushBudget = 8;
+    // coalesced here, then handed over to the hub which sends them
+    ptone::MidiOutQueue<ptone::NUM_FLUSH_PRIORITIES> outQueue;
+    bool resetRequested = false;
     uint8_t sysExDeviceId = -1;
+    // tables of the connected model, inbound notes and CCs and outbound LEDs are routed through them
+    const ptone::ControllerProfile* controller = &ptone::controllerProfile(ptone::Apc40::MODEL_ID);
 
     float device1 = 0.f;
     uint8_t bank = 0;
     bool bankChanged = true;
+    // knob indices of the current bank
+    ptone::DirtySet<KNOB_GROUP_SIZE> bankMask;
+    // banks LEFT and RIGHT cycle through, one channel each on the knob outputs
+    int numBanks = PORT_MAX_CHANNELS;
+    // the knob outputs are monophonic and follow the current bank
+    bool knobsCurrentBankOnly = false;
+    // the knob outputs' channels must be set again
+    bool knobOutputsChanged = false;
 
     // track knob values 
-    float trackKnobVoltage[PORT_MAX_CHANNELS * C_KNOB_NUM] = {0};
-    uint8_t trackKnobMidi[PORT_MAX_CHANNELS * C_KNOB_NUM] = {0};
-    bool trackKnobUpdate[PORT_MAX_CHANNELS * C_KNOB_NUM] = {false};
-    uint8_t trackKnobRingType[PORT_MAX_CHANNELS * C_KNOB_NUM] = {RING_TYPE_SINGLE};
-    bool trackKnobRingTypeUpdate[PORT_MAX_CHANNELS * C_KNOB_NUM] = {false};
+    KnobGroup trackKnobs{C_TRACK_KNOB_1, C_TRACK_KNOB_RING_TYPE_1, TRACK_KNOB_1_OUTPUT, TRACK_KNOB_GROUP, TRACK_RING_INPUT};
     // device knob values 
-    float deviceKnobVoltage[PORT_MAX_CHANNELS * C_KNOB_NUM] = {0};
-    uint8_t deviceKnobMidi[PORT_MAX_CHANNELS * C_KNOB_NUM] = {0};
-    bool deviceKnobUpdate[PORT_MAX_CHANNELS * C_KNOB_NUM] = {false};
-    uint8_t deviceKnobRingType[PORT_MAX_CHANNELS * C_KNOB_NUM] = {RING_TYPE_SINGLE};
-    bool deviceKnobRingTypeUpdate[PORT_MAX_CHANNELS * C_KNOB_NUM] = {false};
+    KnobGroup deviceKnobs{C_DEVICE_KNOB_1, C_DEVICE_KNOB_RING_TYPE_1, DEVICE_KNOB_1_OUTPUT, DEVICE_KNOB_GROUP, DEVICE_RING_INPUT};
     // volume faders
+    uint8_t trackLevelMidi[CHAN_NUM] = {0};
     float trackLevelVoltage[CHAN_NUM] = {0};
     // master level
+    uint8_t masterLevelMidi = 0;
     float masterLevelVoltage = 0.f;
     // x-fader
+    uint8_t xFaderMidi = 0;
     float xFaderVoltage = 0.f;
     // cue
     uint8_t cueMidiValue = 0;
     float cueVoltage = 0.f;
+    // smoothed output voltages of the faders and of master, x-fader and cue
+    ptone::PolySmoother<CHAN_NUM> trackLevelSmoother;
+    ptone::PolySmoother<3> masterSmoother;
+    // knob and fader outputs glide to new values when smoothing is enabled for their group
+    bool smoothing[NUM_OUTPUT_GROUPS] = {false};
+    float smoothingTime = 0.01f;
+    float smoothingLambda = 1.f;
+    float sampleTime = 1 / 48000.f;
+    bool smoothingActive = true;
+    // response curve of each output group, see ptone::VoltageCurve
+    int outputCurve[NUM_OUTPUT_GROUPS] = {ptone::CURVE_LINEAR, ptone::CURVE_LINEAR, ptone::CURVE_LINEAR, ptone::CURVE_LINEAR};
+    bool curvesChanged = false;
     // track LEDs
     uint8_t trackLedMidiValue[CHAN_LED_NUM * CHAN_NUM] = {0};
-    bool trackLedUpdated[CHAN_LED_NUM * CHAN_NUM] = {false};
+    ptone::DirtySet<CHAN_LED_NUM * CHAN_NUM> trackLedUpdated;
     bool trackLedToggle[CHAN_LED_NUM * CHAN_NUM] = {false};
     // shift
     bool isShifted = false;
+    // the clip-launch grid edits the sequencer instead of acting as track LEDs
+    bool sequencerMode = false;
+    ptone::StepSequencer<SEQ_ROWS, CHAN_NUM, SEQ_PAGES> sequencer;
+    // page shown on the grid
+    int sequencerPage = 0;
+    // scene launch buttons store and select snapshots unless they select sequencer pages
+    bool morphMode = false;
+    // device knobs followed by track knobs
+    ptone::SnapshotMorph<2 * KNOB_GROUP_SIZE, MORPH_SNAPSHOTS> morph;
+    // record and play loop the knob and fader values, one lane per output up to CUE_OUTPUT, knob lanes keep the bank as the channel
+    bool looperEnabled = false;
+    ptone::GestureLooper<CUE_OUTPUT + 1, LOOP_CAPACITY> looper;
+    bool looperClearRequested = false;
+    // the audio inputs are mixed by the track faders to the mix output and the crossfader blends the A and B sides,
+    // tracks with solo/cue lit are sent to the cue output before their faders
+    uint8_t crossfadeSide[CHAN_NUM] = {0};
+    ptone::TrackMixer<CHAN_NUM> mixer;
+    float mixerInput[CHAN_NUM] = {0};
+    // the mix outputs were left at 0 V when the mixer went idle
+    bool mixerSilent = true;
+    dsp::SchmittTrigger clockTrigger;
+    dsp::SchmittTrigger sequencerResetTrigger;
+    // gates follow the clock pulses
+    bool sequencerGateOpen = false;
+    // the grid and scene LEDs must be redrawn
+    bool gridChanged = true;
+    bool sceneLedsChanged = true;
+    // clock set by tap tempo, its triggers are written only when they change
+    ptone::TapClock tapClock;
+    dsp::PulseGenerator clockPulse;
+    dsp::PulseGenerator clockResetPulse;
+    bool clockHigh = false;
+    bool clockResetHigh = false;
+    // transport, navigation, scene and master buttons
+    ptone::PulseBank<ptone::NUM_TRIGGER_BUTTONS> buttonPulses;
+    bool buttonGate[ptone::NUM_TRIGGER_BUTTONS] = {false};
+    // frame being processed, inbound messages are timed against it
+    int64_t frame = 0;
+    // clip LEDs set by the clip row inputs, bit row * CHAN_NUM + track, and the LEDs that follow them
+    ptone::CvGates<SEQ_ROWS * CHAN_NUM> clipCv;
+    uint64_t clipCvMask = 0;
+    // a snapshot is sent to an expander on the right when something it shows changed
+    bool expanderChanged = true;
+    uint32_t expanderSequence = 0;
+    uint16_t expanderPresses = 0;
+    // outputs whose voltages must be rewritten
+    ptone::DirtySet<NUM_OUTPUTS> outputUpdate;
 
     Vpc40Module() {
         config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
@@ -111,9 +336,9 @@ struct Vpc40Module : Module {
         configButton(TEST_PARAM, "Test");
         for (int i = 0; i < C_KNOB_NUM; i++) {
             configOutput(DEVICE_KNOB_1_OUTPUT + i, string::f("Device %d", i + 1));
-            outputs[DEVICE_KNOB_1_OUTPUT + i].channels = PORT_MAX_CHANNELS;
+            outputs[DEVICE_KNOB_1_OUTPUT + i].channels = numBanks;
             configOutput(TRACK_KNOB_1_OUTPUT + i, string::f("Track %d", i + 1));
-            outputs[TRACK_KNOB_1_OUTPUT + i].channels = PORT_MAX_CHANNELS;
+            outputs[TRACK_KNOB_1_OUTPUT + i].channels = numBanks;
         }
         for (int i = 0; i < CHAN_NUM; i++) {
             configOutput(TRACK_LEVEL_1_OUTPUT + i, string::f("Level %d", i + 1));
@@ -121,17 +346,76 @@ struct Vpc40Module : Module {
         configOutput(MASTER_LEVEL_OUTPUT, "Master level");
         configOutput(X_FADER_OUTPUT, "X-Fader level");
         configOutput(CUE_OUTPUT, "Cue level");
+        configInput(CLOCK_INPUT, "Clock");
+        configInput(SEQ_RESET_INPUT, "Sequencer reset");
+        configInput(DEVICE_RING_INPUT, "Device knob rings")->description = "0-10 V, one channel per knob, shown on the rings instead of the knob values";
+        configInput(TRACK_RING_INPUT, "Track knob rings")->description = "0-10 V, one channel per knob, shown on the rings instead of the knob values";
+        for (int i = 0; i < SEQ_ROWS; i++) {
+            configInput(CLIP_ROW_1_INPUT + i, string::f("Clip row %d LEDs", i + 1))->description = "One channel per track, lit from 1 V until 0 V";
+        }
+        configOutput(SEQ_GATE_OUTPUT, "Sequencer gates");
+        configOutput(CLOCK_OUTPUT, "Clock");
+        configOutput(CLOCK_RESET_OUTPUT, "Clock reset");
+        configOutput(BUTTON_TRIGGER_OUTPUT, "Button triggers")->description = "Play, stop, record, up, down, stop all clips, scenes 1-5, master";
+        configOutput(BUTTON_GATE_OUTPUT, "Button gates")->description = "Play, stop, record, up, down, stop all clips, scenes 1-5, master";
         for (int i = 0; i < CHAN_NUM; i++) {
             configOutput(LED_OUTPUT_1 + i, string::f("Channel %d leds", i + 1));
         }
+        for (int i = 0; i < CHAN_NUM; i++) {
+            configInput(TRACK_AUDIO_1_INPUT + i, string::f("Track %d audio", i + 1))->description = "Polyphonic inputs are summed";
+        }
+        configOutput(MIX_OUTPUT, "Mix");
+        configOutput(CUE_MIX_OUTPUT, "Cue mix")->description = "Tracks with solo/cue lit, before their faders";
         ioPort.input = &midiInput;
         ioPort.output = &midiOutput;
+        setBank(0);
+        outputUpdate.setAll();
+        trackLevelSmoother.wakeAll();
+        masterSmoother.wakeAll();
+    }
+
+    ~Vpc40Module() {
+        // the engine's hub is either of them
+        if (retiredHub) {
+            ptone::DeviceHub::release(retiredHub, retiredSubscriber);
+        }
+        if (nextHub) {
+            ptone::DeviceHub::release(nextHub, nextHubSubscriber);
+        }
+    }
+
+    void onAdd(const AddEvent& e) override {
+        // the widget follows device changes, without one, e.g. in headless Rack, the device is only set when the module is added or loaded
+        updateHub();
+    }
+
+    void onSampleRateChange(const SampleRateChangeEvent& e) override {
+        flushPeriodFrames = std::max(1, (int) std::round(e.sampleRate / flushRate));
+        flushCountdown = std::min(flushCountdown, flushPeriodFrames);
+        sampleTime = e.sampleTime;
+        setSmoothingTime(smoothingTime);
+        mixer.lambda = 1.f - std::exp(-sampleTime / MIXER_SMOOTHING_TIME);
+        tapClock.setSampleRate(e.sampleRate);
+        setInboundLatency(inboundLatency);
+    }
+
+    void setInboundLatency(float latency) {
+        inboundLatency = latency;
+        inboundLatencyFrames = (int) std::round(latency / sampleTime);
+    }
+
+    void setSmoothingTime(float time) {
+        smoothingTime = time;
+        smoothingLambda = 1.f - std::exp(-sampleTime / smoothingTime);
     }
 
     void process(const ProcessArgs &args) override {
-        bool rateLimitTriggered = (rateLimitTimer.process(args.sampleTime) > rateLimitPeriod);
-        if(rateLimitTriggered) rateLimitTimer.time -= rateLimitPeriod;
+        PROFILE_BEGIN(profiler);
+        frame = args.frame;
+        bool flushTriggered = (--flushCountdown <= 0);
+        if (flushTriggered) flushCountdown = flushPeriodFrames;
         if(resetButtonTrigger.process(params[RESET_PARAM].getValue())) {
+            resetRequested = true;
             inquireDevice();
         }
         if(testButtonTrigger.process(params[TEST_PARAM].getValue())) {
@@ -139,149 +423,682 @@ struct Vpc40Module : Module {
             testLedRingType(args);
             testLedRing(args);
         }
-        Message inboundMidi;
-        while (midiInput.tryPop(&inboundMidi, args.frame)) {
-            //DEBUG("Channel: %d, Status: %d, Note/CC: %d, Value: %d", inboundMidi.getChannel(), inboundMidi.getStatus(), inboundMidi.getNote(), inboundMidi.getValue());
-            if (inboundMidi.bytes[0] == 0xF0 && 
-                    inboundMidi.bytes[3] == 0x06 &&
-                    inboundMidi.bytes[4] == 0x02) {
-                processInquireResponse(inboundMidi);
-                introduce();
-                reset();
+        if (hub) {
+            hub->poll(args.frame);
+        }
+        while (!hubSubscriber->events.empty()) {
+            ptone::DeviceEvent& event = hubSubscriber->events.front();
+            stats.inboundMessages++;
+            if (event.frame >= 0) {
+                stats.inboundLatency.add(std::max((int64_t) 0, args.frame - event.frame));
+            }
+            if (inboundLatencyFrames > 0 && delayedMidi.full()) {
+                stats.delayOverflows++;
+            }
+            if (inboundLatencyFrames > 0 && event.status != EVENT_INQUIRY_REPLY && !delayedMidi.full()) {
+                // applied on its own frame, the latency keeps the spacing of messages popped in one block
+                event.frame = std::max(event.frame, args.frame - inboundLatencyFrames) + inboundLatencyFrames;
+                delayedMidi.push(event);
+            } else {
+                PROFILE_MARK(profiler, PROFILE_DRAIN);
+                processMessage(event);
+                PROFILE_MARK(profiler, PROFILE_DISPATCH);
+            }
+            hubSubscriber->events.pop();
+        }
+        while (!delayedMidi.empty() && delayedMidi.front().frame <= args.frame) {
+            PROFILE_MARK(profiler, PROFILE_DRAIN);
+            processMessage(delayedMidi.front());
+            PROFILE_MARK(profiler, PROFILE_DISPATCH);
+            delayedMidi.pop();
+        }
+        PROFILE_MARK(profiler, PROFILE_DRAIN);
+        if (morphMode && morph.changed) {
+            processMorph();
+        }
+
+        bool tapTicked = tapClock.process(args.frame);
+        if (tapTicked) {
+            clockPulse.trigger(1e-3f);
+        }
+        processTrigger(clockPulse, clockHigh, CLOCK_OUTPUT);
+        processTrigger(clockResetPulse, clockResetHigh, CLOCK_RESET_OUTPUT);
+        if (buttonPulses.isActive()) {
+            buttonPulses.process([&](int g, simd::float_4 v) {
+                outputs[BUTTON_TRIGGER_OUTPUT].setVoltageSimd(v, 4 * g);
+            });
+        }
+        bool clockTicked = false;
+        if (inputs[CLOCK_INPUT].isConnected()) {
+            clockTicked = processSequencer();
+        }
+        if (looperEnabled && looper.state != looper.EMPTY) {
+            // the looper follows the clock input, or the tap clock without one
+            processLooper(inputs[CLOCK_INPUT].isConnected() ? clockTicked : tapTicked);
+        }
+        if (expanderChanged) {
+            sendExpanderMessage();
+        }
+        PROFILE_MARK(profiler, PROFILE_CLOCK);
+
+        if (flushTriggered) {
+            if (curvesChanged) {
+                curvesChanged = false;
+                applyCurves();
             }
-            
-            if (isNoteOn(inboundMidi)) {
-                processNoteOn(inboundMidi);
-            } else if (isNoteOff(inboundMidi)) {
-                processNoteOff(inboundMidi);
-            } else if (isCc(inboundMidi)) {
-                processCc(inboundMidi);
-            }
-        }
-
-        if (rateLimitTriggered) {
-            for (int k = 0; k < C_KNOB_NUM; k++) {
-                int ki = knobIndex(k, bank);
-                if (bankChanged) {
-                    // update device ringType
-                    setCc(args.frame, 0, C_DEVICE_KNOB_RING_TYPE_1 + k, deviceKnobRingType[ki]);
-                    // update device knobValue
-                    setCc(args.frame, 0, C_DEVICE_KNOB_1 + k, deviceKnobMidi[ki]);
-                    // update track ringType
-                    setCc(args.frame, 0, C_TRACK_KNOB_RING_TYPE_1 + k, trackKnobRingType[ki]);
-                    // update track knob values
-                    setCc(args.frame, 0, C_TRACK_KNOB_1 + k, trackKnobMidi[ki]);
-                } 
-                if (deviceKnobUpdate[ki]) {
-                    // update knobValue
-                    setCc(args.frame, 0, C_DEVICE_KNOB_1 + k, deviceKnobMidi[ki]);
-                    deviceKnobUpdate[ki] = false;
-                } 
-                if (deviceKnobRingTypeUpdate[ki]) {
-                    setCc(args.frame, 0, C_DEVICE_KNOB_RING_TYPE_1 + k, deviceKnobRingType[ki]);
-                    deviceKnobRingTypeUpdate[ki] = false;
+            if (looperClearRequested) {
+                looper.clear();
+                looperClearRequested = false;
+            }
+            if (knobOutputsChanged) {
+                knobOutputsChanged = false;
+                applyNumBanks();
+            }
+            if (hubSwitchRequested.load(std::memory_order_acquire)) {
+                switchHub();
+            }
+            if (bankChanged) {
+                // resend the whole bank
+                deviceKnobs.ringTypeUpdate.merge(bankMask);
+                deviceKnobs.valueUpdate.merge(bankMask);
+                trackKnobs.ringTypeUpdate.merge(bankMask);
+                trackKnobs.valueUpdate.merge(bankMask);
+                bankChanged = false;
+            }
+            if (gridChanged) {
+                for (int c = 0; c < CHAN_NUM; c++) {
+                    for (int row = 0; row < SEQ_ROWS; row++) {
+                        trackLedUpdated.set(trackLedIndex(LED_CLIP_LAUNCH_1 - LED_RECORD + row, c));
+                    }
                 }
-                if (trackKnobUpdate[ki]) {
-                    // update knobValue
-                    setCc(args.frame, 0, C_TRACK_KNOB_1 + k, trackKnobMidi[ki]);
-                    trackKnobUpdate[ki] = false;
+                sceneLedsChanged = true;
+                expanderChanged = true;
+                gridChanged = false;
+            }
+            processRingInput(deviceKnobs);
+            processRingInput(trackKnobs);
+            processClipInputs();
+            // only the current bank is shown, other banks keep their updates until selected
+            flushKnobs(deviceKnobs);
+            flushKnobs(trackKnobs);
+            trackLedUpdated.drain([&](int ledIndex) {
+                uint8_t c = ledIndex / CHAN_LED_NUM;
+                uint8_t l = ledIndex % CHAN_LED_NUM;
+                uint8_t value = getTrackLedValue(ledIndex);
+                if (value == LED_OFF) {
+                    setLedOff(c, LED_RECORD + l);
                 }
-                if (trackKnobRingTypeUpdate[ki]) {
-                    setCc(args.frame, 0, C_TRACK_KNOB_RING_TYPE_1 + k, trackKnobRingType[ki]);
-                    trackKnobRingTypeUpdate[ki] = false;
+                else {
+                    setLedOn(c, LED_RECORD + l, value);
                 }
+            });
+            if (sceneLedsChanged) {
+                flushSceneLeds();
+                sceneLedsChanged = false;
             }
-            bankChanged = false;
-            for (uint8_t c = 0; c < CHAN_NUM; c++) {
-                for (uint8_t l = 0; l < CHAN_LED_NUM; l++) {
-                    int ledIndex = trackLedIndex(l, c);
-                    if (!trackLedUpdated[ledIndex]) continue;
-                    if (trackLedMidiValue[ledIndex] == LED_OFF) {
-                        setLedOff(args.frame, c, LED_RECORD + l);
-                    }
-                    else {
-                        setLedOn(args.frame, c, LED_RECORD + l, trackLedMidiValue[ledIndex]);
-                    }
-                    trackLedUpdated[ledIndex] = false;
+            // without a device the messages stay queued, the device is resynced once one is selected
+            int sent = hub ? hub->flush(args.frame, hubSubscriber, outQueue, flushBudget, flushPeriodFrames) : 0;
+            updateStats(args, sent);
+            updateMixer();
+            PROFILE_MARK(profiler, PROFILE_FLUSH);
+        }
+
+        // output voltages are held by the engine, so nothing is written until something changes
+        if (smoothingActive) {
+            processSmoothing();
+        }
+        if (outputUpdate.any()) {
+            processOutputs();
+        }
+        PROFILE_MARK(profiler, PROFILE_OUTPUTS);
+        if (mixer.isActive()) {
+            processMixer();
+        } else if (!mixerSilent) {
+            outputs[MIX_OUTPUT].setVoltage(0.f);
+            outputs[CUE_MIX_OUTPUT].setVoltage(0.f);
+            mixerSilent = true;
+        }
+        PROFILE_MARK(profiler, PROFILE_MIXER);
+#ifdef VPC40_PROFILE
+        if (profilerResetRequested) {
+            profiler.clear();
+            profilerResetRequested = false;
+        }
+#endif
+        PROFILE_END(profiler);
+    }
+
+    float getSmoothingLambda(int outputGroup) {
+        // without smoothing the voltages jump in one step
+        return smoothing[outputGroup] ? smoothingLambda : 1.f;
+    }
+
+    void processSmoothing() {
+        processKnobSmoothing(deviceKnobs);
+        processKnobSmoothing(trackKnobs);
+        if (trackLevelSmoother.isActive()) {
+            trackLevelSmoother.process(trackLevelVoltage, getSmoothingLambda(TRACK_LEVEL_GROUP), [&](int g, simd::float_4 v) {
+                for (int i = 0; i < 4; i++) {
+                    outputs[TRACK_LEVEL_1_OUTPUT + 4 * g + i].setVoltage(v[i]);
                 }
+            });
+        }
+        if (masterSmoother.isActive()) {
+            float masterVoltage[4] = {masterLevelVoltage, xFaderVoltage, cueVoltage, 0.f};
+            masterSmoother.process(masterVoltage, getSmoothingLambda(MASTER_GROUP), [&](int g, simd::float_4 v) {
+                outputs[MASTER_LEVEL_OUTPUT].setVoltage(v[0]);
+                outputs[X_FADER_OUTPUT].setVoltage(v[1]);
+                outputs[CUE_OUTPUT].setVoltage(v[2]);
+            });
+        }
+        smoothingActive = trackLevelSmoother.isActive() || masterSmoother.isActive();
+        for (int k = 0; k < C_KNOB_NUM; k++) {
+            smoothingActive |= deviceKnobs.smoothers[k].isActive() || trackKnobs.smoothers[k].isActive();
+        }
+    }
+
+    // called on each flush, the gains follow the controls at the flush rate and glide in between
+    void updateMixer() {
+        uint32_t connected = 0;
+        for (int t = 0; t < CHAN_NUM; t++) {
+            if (inputs[TRACK_AUDIO_1_INPUT + t].isConnected()) {
+                connected |= 1u << (t / 4);
             }
         }
+        mixer.connectedGroups = connected;
+        if (!connected) return;
+        // gains follow the MIDI values, the response curves only shape the CV outputs
+        float x = xFaderMidi / 127.f;
+        // both sides play at full level in the middle
+        float sideGain[NUM_XFADE_SIDES] = {1.f, std::min(2.f - 2.f * x, 1.f), std::min(2.f * x, 1.f)};
+        float master = masterLevelMidi / 127.f;
+        float cue = cueMidiValue / 127.f;
+        float gain[CHAN_NUM];
+        float cueGain[CHAN_NUM];
+        for (int t = 0; t < CHAN_NUM; t++) {
+            gain[t] = trackLevelMidi[t] / 127.f * sideGain[crossfadeSide[t]] * master;
+            cueGain[t] = trackLedMidiValue[trackLedIndex(LED_SOLO - LED_RECORD, t)] != LED_OFF ? cue : 0.f;
+        }
+        mixer.setTargets(gain, cueGain);
+    }
 
-        for (uint8_t c = 0; c < PORT_MAX_CHANNELS; c++) {
-            for(int k = 0; k < C_KNOB_NUM; k++) {
-                // update track knob outputs
-                int ki = knobIndex(k, c);
-                if (outputs[TRACK_KNOB_1_OUTPUT + k].isConnected()) {
-                    outputs[TRACK_KNOB_1_OUTPUT + k].setVoltage(trackKnobVoltage[ki], c);
-                }
-                // update device knob outputs
-                if (outputs[DEVICE_KNOB_1_OUTPUT + k].isConnected()) {
-                    outputs[DEVICE_KNOB_1_OUTPUT + k].setVoltage(deviceKnobVoltage[ki], c);
+    void processMixer() {
+        for (int t = 0; t < CHAN_NUM; t++) {
+            mixerInput[t] = inputs[TRACK_AUDIO_1_INPUT + t].getVoltageSum();
+        }
+        float mix;
+        float cue;
+        mixer.process(mixerInput, mix, cue);
+        outputs[MIX_OUTPUT].setVoltage(mix);
+        outputs[CUE_MIX_OUTPUT].setVoltage(cue);
+        mixerSilent = false;
+    }
+
+    void processKnobSmoothing(KnobGroup& knobs) {
+        float lambda = getSmoothingLambda(knobs.outputGroup);
+        for (int k = 0; k < C_KNOB_NUM; k++) {
+            if (!knobs.smoothers[k].isActive()) continue;
+            rack::engine::Output& output = outputs[knobs.firstOutputId + k];
+            knobs.smoothers[k].process(&knobs.voltage[knobIndex(k, 0)], lambda, [&](int g, simd::float_4 v) {
+                if (!knobsCurrentBankOnly) {
+                    output.setVoltageSimd(v, 4 * g);
+                } else if (g == bank / 4) {
+                    output.setVoltage(v[bank % 4]);
                 }
+            });
+        }
+    }
+
+    void flushKnobs(KnobGroup& knobs) {
+        // ring types go first, the device resets the ring value when its type changes
+        knobs.ringTypeUpdate.drain(bankMask, [&](int ki) {
+            uint8_t knob = ki / PORT_MAX_CHANNELS;
+            if (setCc(ptone::RING_TYPE_PRIORITY, 0, knobs.ringTypeCc + knob, knobs.ringType[ki])) {
+                // the value is resent after a ring type change
+                outQueue.forget(STATUS_CC, 0, knobs.valueCc + knob);
+                knobs.valueUpdate.set(ki);
             }
+        });
+        knobs.valueUpdate.drain(bankMask, [&](int ki) {
+            uint8_t knob = ki / PORT_MAX_CHANNELS;
+            uint8_t value = (knobs.ringCvMask >> knob) & 1 ? knobs.ringCv.value[knob] : knobs.midi[ki];
+            setCc(ptone::RING_VALUE_PRIORITY, 0, knobs.valueCc + knob, value);
+        });
+    }
+
+    // read on each flush, a ring is only sent when its quantized value changes
+    void processRingInput(KnobGroup& knobs) {
+        rack::engine::Input& input = inputs[knobs.ringInputId];
+        int channels = std::min(input.getChannels(), C_KNOB_NUM);
+        uint8_t mask = (1 << channels) - 1;
+        // rings that start or stop following the input are redrawn
+        uint8_t changed = knobs.ringCvMask ^ mask;
+        knobs.ringCvMask = mask;
+        for (int k = 0; k < channels; k++) {
+            if (knobs.ringCv.process(k, input.getVoltage(k))) {
+                changed |= 1 << k;
+            }
+        }
+        while (changed) {
+            knobs.valueUpdate.set(knobIndex(__builtin_ctz(changed), bank));
+            changed &= changed - 1;
         }
-        for(uint8_t t = 0; t < CHAN_NUM; t++) {
-            if(outputs[TRACK_LEVEL_1_OUTPUT + t].isConnected()) {
-                outputs[TRACK_LEVEL_1_OUTPUT + t].setVoltage(trackLevelVoltage[t]);
+    }
+
+    void processClipInputs() {
+        uint64_t changed = 0;
+        for (int row = 0; row < SEQ_ROWS; row++) {
+            rack::engine::Input& input = inputs[CLIP_ROW_1_INPUT + row];
+            int channels = std::min(input.getChannels(), CHAN_NUM);
+            uint64_t rowMask = uint64_t((1 << CHAN_NUM) - 1) << (row * CHAN_NUM);
+            uint64_t mask = uint64_t((1 << channels) - 1) << (row * CHAN_NUM);
+            changed |= (clipCvMask ^ mask) & rowMask;
+            clipCvMask = (clipCvMask & ~rowMask) | mask;
+            for (int t = 0; t < channels; t++) {
+                if (clipCv.process(row * CHAN_NUM + t, input.getVoltage(t))) {
+                    changed |= uint64_t(1) << (row * CHAN_NUM + t);
+                }
             }
         }
-        for (uint8_t c = 0; c < CHAN_LED_NUM; c++) {
-            for (uint8_t t = 0; t < CHAN_NUM; t++) {
-                if (outputs[LED_OUTPUT_1 + t].isConnected()) {
-                    int ledIndex = trackLedIndex(c, t);
-                    if (trackLedMidiValue[ledIndex] == LED_OFF) {
-                        outputs[LED_OUTPUT_1 + t].setVoltage(0.0f, c);
-                    } else {
-                        outputs[LED_OUTPUT_1 + t].setVoltage(10.0f, c);
-                    }
+        if (!changed) return;
+        while (changed) {
+            int bit = __builtin_ctzll(changed);
+            trackLedUpdated.set(trackLedIndex(LED_CLIP_LAUNCH_1 - LED_RECORD + bit / CHAN_NUM, bit % CHAN_NUM));
+            changed &= changed - 1;
+        }
+        expanderChanged = true;
+    }
+
+    void processOutputs() {
+        outputUpdate.drain([&](int outputId) {
+            // a disconnected output is rewritten by onPortChange once it gets connected
+            if (!outputs[outputId].isConnected()) return;
+            if (outputId >= DEVICE_KNOB_1_OUTPUT && outputId <= DEVICE_KNOB_8_OUTPUT) {
+                processKnobOutput(outputId, deviceKnobs);
+            } else if (outputId >= TRACK_KNOB_1_OUTPUT && outputId <= TRACK_KNOB_8_OUTPUT) {
+                processKnobOutput(outputId, trackKnobs);
+            } else if (outputId >= TRACK_LEVEL_1_OUTPUT && outputId <= TRACK_LEVEL_8_OUTPUT) {
+                outputs[outputId].setVoltage(trackLevelSmoother.getValue(outputId - TRACK_LEVEL_1_OUTPUT));
+            } else if (outputId >= LED_OUTPUT_1 && outputId <= LED_OUTPUT_8) {
+                processLedOutput(outputId, outputId - LED_OUTPUT_1);
+            } else if (outputId >= MASTER_LEVEL_OUTPUT && outputId <= CUE_OUTPUT) {
+                outputs[outputId].setVoltage(masterSmoother.getValue(outputId - MASTER_LEVEL_OUTPUT));
+            } else if (outputId == SEQ_GATE_OUTPUT) {
+                processSequencerOutput();
+            } else if (outputId == CLOCK_OUTPUT) {
+                outputs[outputId].setVoltage(clockHigh ? 10.f : 0.f);
+            } else if (outputId == CLOCK_RESET_OUTPUT) {
+                outputs[outputId].setVoltage(clockResetHigh ? 10.f : 0.f);
+            } else if (outputId == BUTTON_GATE_OUTPUT) {
+                for (int b = 0; b < ptone::NUM_TRIGGER_BUTTONS; b++) {
+                    outputs[outputId].setVoltage(buttonGate[b] ? 10.f : 0.f, b);
                 }
             }
+        });
+    }
+
+    void processKnobOutput(int outputId, KnobGroup& knobs) {
+        ptone::PolySmoother<PORT_MAX_CHANNELS>& smoother = knobs.smoothers[outputId - knobs.firstOutputId];
+        if (knobsCurrentBankOnly) {
+            outputs[outputId].setVoltage(smoother.getValue(bank));
+            return;
+        }
+        for (int g = 0; g < (numBanks + 3) / 4; g++) {
+            outputs[outputId].setVoltageSimd(smoother.value[g], 4 * g);
+        }
+    }
+
+    void processLedOutput(int outputId, uint8_t track) {
+        for (uint8_t l = 0; l < CHAN_LED_NUM; l++) {
+            int ledIndex = trackLedIndex(l, track);
+            if (trackLedMidiValue[ledIndex] == LED_OFF) {
+                outputs[outputId].setVoltage(0.0f, l);
+            } else {
+                outputs[outputId].setVoltage(10.0f, l);
+            }
         }
-        if (outputs[MASTER_LEVEL_OUTPUT].isConnected()) {
-            outputs[MASTER_LEVEL_OUTPUT].setVoltage(masterLevelVoltage);
+    }
+
+    // called on each flush
+    void updateStats(const ProcessArgs& args, int sent) {
+        if (statsResetRequested) {
+            stats.clear(args.frame);
+            outQueue.coalesced = 0;
+            outQueue.suppressed = 0;
+            hubSubscriber->overflows = 0;
+            resetHubOverflowBase();
+            statsResetRequested = false;
         }
-        if (outputs[X_FADER_OUTPUT].isConnected()) {
-            outputs[X_FADER_OUTPUT].setVoltage(xFaderVoltage);
+        stats.outboundMessages += sent;
+        if (sent > 0) {
+            stats.flushSize.add(sent);
         }
-        if (outputs[CUE_OUTPUT].isConnected()) {
-            outputs[CUE_OUTPUT].setVoltage(cueVoltage);
+        stats.outboundBacklog.add(outQueue.size());
+        stats.delayedDepth.add(delayedMidi.size());
+        if (hub) {
+            stats.deviceRingOverflows = hub->input.overflows.load(std::memory_order_relaxed) - deviceRingOverflowBase;
+            stats.senderOverflows = hub->senderOverflows.load(std::memory_order_relaxed) - senderOverflowBase;
+        } else {
+            stats.deviceRingOverflows = 0;
+            stats.senderOverflows = 0;
         }
+        stats.moduleRingOverflows = hubSubscriber->overflows.load(std::memory_order_relaxed);
+        stats.updateRates(args.frame, args.sampleRate);
     }
 
-    bool isNoteOn(Message &msg) {
-        return msg.getStatus() == STATUS_NOTE_ON;
+    void resetHubOverflowBase() {
+        deviceRingOverflowBase = hub ? hub->input.overflows.load(std::memory_order_relaxed) : 0;
+        senderOverflowBase = hub ? hub->senderOverflows.load(std::memory_order_relaxed) : 0;
     }
 
-    bool isNoteOff(Message &msg) {
-        return msg.getStatus() == STATUS_NOTE_OFF;
+    void exportStats(const std::string& path) {
+        std::string csv = stats.toCsv(1.f / sampleTime, outQueue.coalesced, outQueue.suppressed);
+        FILE* file = std::fopen(path.c_str(), "w");
+        if (!file) {
+            WARN("Could not write MIDI statistics to %s", path.c_str());
+            return;
+        }
+        std::fputs(csv.c_str(), file);
+        std::fclose(file);
+    }
+
+#ifdef VPC40_PROFILE
+    void exportProfile(const std::string& path) {
+        std::string csv = profiler.toCsv(PROFILE_PHASE_NAMES);
+        FILE* file = std::fopen(path.c_str(), "w");
+        if (!file) {
+            WARN("Could not write profile to %s", path.c_str());
+            return;
+        }
+        std::fputs(csv.c_str(), file);
+        std::fclose(file);
+    }
+#endif
+
+    /** Follows the selected device, called on the UI thread so that creating a hub and opening its ports never holds up the engine.
+    Called when the module is added or loaded, and by its widget on every step.
+    */
+    void updateHub() {
+        // the engine has not switched to the last hub yet
+        if (hubSwitchRequested.load(std::memory_order_acquire)) return;
+        if (retiredHub) {
+            ptone::DeviceHub::release(retiredHub, retiredSubscriber);
+            retiredHub = NULL;
+        }
+        int driverId = ioPort.getDriverId();
+        int deviceId = ioPort.getDeviceId();
+        if (driverId == hubDriverId && deviceId == hubDeviceId) return;
+        hubDriverId = driverId;
+        hubDeviceId = deviceId;
+        // its hub was released above, and the engine reads the other one
+        ptone::DeviceHub::Subscriber* subscriber = nextHubSubscriber == &hubSubscribers[0] ? &hubSubscribers[1] : &hubSubscribers[0];
+        subscriber->events.clear();
+        subscriber->overflows = 0;
+        subscriber->direct.clear();
+        retiredHub = nextHub;
+        retiredSubscriber = nextHubSubscriber;
+        nextHub = deviceId >= 0 ? ptone::DeviceHub::acquire(driverId, deviceId, subscriber) : NULL;
+        nextHubSubscriber = subscriber;
+        hubSwitchRequested.store(true, std::memory_order_release);
+    }
+
+    // called on a flush after updateHub published a hub
+    void switchHub() {
+        hub = nextHub;
+        hubSubscriber = nextHubSubscriber;
+        // the previous hub is no longer used and may be released
+        hubSwitchRequested.store(false, std::memory_order_release);
+        resetHubOverflowBase();
+        if (hub) {
+            // a newly selected device has to be introduced, the reply triggers a resync
+            inquireDevice();
+        }
+    }
+
+    void processMessage(const ptone::DeviceEvent& event) {
+        messageFrame = event.frame < 0 ? frame : event.frame;
+        if (event.status == EVENT_INQUIRY_REPLY) {
+            processInquireResponse(event);
+            introduce();
+            if (resetRequested) {
+                reset();
+                resetRequested = false;
+            }
+            resync();
+        } else if (event.status == STATUS_NOTE_ON) {
+            processNoteOn(event);
+        } else if (event.status == STATUS_NOTE_OFF) {
+            processNoteOff(event);
+        } else if (event.status == STATUS_CC) {
+            processCc(event);
+        }
+    }
+
+    void sendExpanderMessage() {
+        expanderChanged = false;
+        if (!rightExpander.module || rightExpander.module->model != modelVpc40Expander) {
+            // onExpanderChange sends a fresh snapshot once one is attached
+            expanderPresses = 0;
+            return;
+        }
+        ptone::Vpc40ExpanderMessage* message = (ptone::Vpc40ExpanderMessage*) rightExpander.module->leftExpander.producerMessage;
+        message->sequence = ++expanderSequence;
+        message->bank = bank;
+        message->buttonGates = 0;
+        for (int b = 0; b < ptone::NUM_TRIGGER_BUTTONS; b++) {
+            message->buttonGates |= buttonGate[b] << b;
+        }
+        message->buttonPresses = expanderPresses;
+        // the grid as drawn on the device, the sequencer in sequencer mode
+        message->clipLeds = 0;
+        for (int row = 0; row < SEQ_ROWS; row++) {
+            for (int t = 0; t < CHAN_NUM; t++) {
+                if (getTrackLedValue(trackLedIndex(LED_CLIP_LAUNCH_1 - LED_RECORD + row, t)) != LED_OFF) {
+                    message->clipLeds |= uint64_t(1) << (row * CHAN_NUM + t);
+                }
+            }
+        }
+        rightExpander.module->leftExpander.requestMessageFlip();
+        expanderPresses = 0;
     }
 
-    bool isCc(Message &msg) {
-        return msg.getStatus() == STATUS_CC;
+    void onExpanderChange(const ExpanderChangeEvent& e) override {
+        expanderChanged = true;
     }
 
-    void processNoteOn(Message &msg) {
-        uint8_t note = msg.getNote();
-        if (isTrackLed(note)) {
-            processTrackLedOn(note, msg.getChannel());
+    void processTrigger(dsp::PulseGenerator& pulse, bool& high, int outputId) {
+        if (!high && pulse.remaining <= 0.f) return;
+        bool newHigh = pulse.process(sampleTime);
+        if (newHigh != high) {
+            high = newHigh;
+            outputs[outputId].setVoltage(high ? 10.f : 0.f);
+        }
+    }
+
+    void processSequencerOutput() {
+        for (int row = 0; row < SEQ_ROWS; row++) {
+            outputs[SEQ_GATE_OUTPUT].setVoltage(sequencerGateOpen && sequencer.isGate(row) ? 10.f : 0.f, row);
+        }
+    }
+
+    // runs every sample while the clock is connected, so gates open on the sample of the clock edge
+    // returns true on a clock tick
+    bool processSequencer() {
+        if (sequencerResetTrigger.process(inputs[SEQ_RESET_INPUT].getVoltage(), 0.1f, 1.f)) {
+            moveSequencerPlayhead(true);
+        }
+        if (clockTrigger.process(inputs[CLOCK_INPUT].getVoltage(), 0.1f, 1.f)) {
+            moveSequencerPlayhead(false);
+            sequencerGateOpen = true;
+            outputUpdate.set(SEQ_GATE_OUTPUT);
+            return true;
+        } else if (sequencerGateOpen && !clockTrigger.isHigh()) {
+            sequencerGateOpen = false;
+            outputUpdate.set(SEQ_GATE_OUTPUT);
+        }
+        return false;
+    }
+
+    void processLooper(bool ticked) {
+        // played values ramp from the current frame like received ones
+        messageFrame = frame;
+        looper.process(ticked, [&](int lane, uint8_t channel, uint8_t value) {
+            if (lane <= DEVICE_KNOB_8_OUTPUT) {
+                processKnobValue(deviceKnobs, knobIndex(lane - DEVICE_KNOB_1_OUTPUT, channel), value);
+            } else if (lane <= TRACK_KNOB_8_OUTPUT) {
+                processKnobValue(trackKnobs, knobIndex(lane - TRACK_KNOB_1_OUTPUT, channel), value);
+            } else if (lane <= TRACK_LEVEL_8_OUTPUT) {
+                processTrackLevel(lane - TRACK_LEVEL_1_OUTPUT, value);
+            } else if (lane == MASTER_LEVEL_OUTPUT) {
+                processMasterLevel(value);
+            } else if (lane == X_FADER_OUTPUT) {
+                processXFaderLevel(value);
+            } else {
+                setCueLevel(value);
+            }
+        });
+    }
+
+    void moveSequencerPlayhead(bool rewind) {
+        int previousStep = sequencer.step;
+        if (rewind) {
+            sequencer.rewind();
         } else {
-            switch(note) {
-                case BTN_RIGHT:
-                    processBtnRightOn();
-                    break;
-                case BTN_LEFT:
-                    processBtnLeftOn();
-                    break;
-                case BTN_SHIFT:
-                    processShiftOn();
-                    break;
+            sequencer.advance();
+        }
+        // only the columns the playhead left and entered are redrawn
+        updateSequencerColumn(previousStep);
+        updateSequencerColumn(sequencer.step);
+        if (previousStep < 0 || sequencer.step < 0 || previousStep / CHAN_NUM != sequencer.step / CHAN_NUM) {
+            sceneLedsChanged = true;
+        }
+    }
+
+    void updateSequencerColumn(int step) {
+        if (!sequencerMode || step < 0 || step / CHAN_NUM != sequencerPage) return;
+        for (int row = 0; row < SEQ_ROWS; row++) {
+            trackLedUpdated.set(trackLedIndex(LED_CLIP_LAUNCH_1 - LED_RECORD + row, step % CHAN_NUM));
+        }
+        expanderChanged = true;
+    }
+
+    // the value shown by a track LED, the clip-launch grid draws the sequencer in sequencer mode
+    uint8_t getTrackLedValue(int ledIndex) {
+        int led = ledIndex % CHAN_LED_NUM;
+        if (led >= LED_CLIP_LAUNCH_1 - LED_RECORD) {
+            // the clip row inputs take precedence over the sequencer and the buttons
+            int bit = (led - (LED_CLIP_LAUNCH_1 - LED_RECORD)) * CHAN_NUM + ledIndex / CHAN_LED_NUM;
+            if ((clipCvMask >> bit) & 1) {
+                return clipCv.isHigh(bit) ? LED_GREEN : LED_OFF;
+            }
+        }
+        if (!sequencerMode || led < LED_CLIP_LAUNCH_1 - LED_RECORD) {
+            return trackLedMidiValue[ledIndex];
+        }
+        int row = led - (LED_CLIP_LAUNCH_1 - LED_RECORD);
+        int step = sequencerPage * CHAN_NUM + ledIndex / CHAN_LED_NUM;
+        bool gate = sequencer.get(row, step);
+        if (step == sequencer.step) {
+            return gate ? LED_GREEN_BLINK : LED_YELLOW_BLINK;
+        }
+        if (step >= sequencer.length) {
+            // steps past the end are kept but not played
+            return gate ? LED_RED : LED_OFF;
+        }
+        return gate ? LED_GREEN : LED_OFF;
+    }
+
+    void flushSceneLeds() {
+        for (int page = 0; page < SEQ_PAGES; page++) {
+            uint8_t value = LED_OFF;
+            if (sequencerMode && page == sequencerPage) {
+                value = LED_ON;
+            } else if (sequencerMode && sequencer.step >= 0 && sequencer.step / CHAN_NUM == page) {
+                value = LED_BLINK;
+            } else if (!sequencerMode && morphMode && (page == morph.a || page == morph.b)) {
+                // the snapshots being morphed blink, the other stored ones are lit
+                value = LED_BLINK;
+            } else if (!sequencerMode && morphMode && morph.isStored(page)) {
+                value = LED_ON;
             }
+            if (value == LED_OFF) {
+                setLedOff(0, LED_SCENE_LAUNCH_1 + page);
+            } else {
+                setLedOn(0, LED_SCENE_LAUNCH_1 + page, value);
+            }
+        }
+    }
+
+    void setSequencerMode(bool mode) {
+        sequencerMode = mode;
+        gridChanged = true;
+    }
+
+    void setSequenceLength(int length) {
+        sequencer.setLength(length);
+        gridChanged = true;
+    }
+
+    void processNoteOn(const ptone::DeviceEvent& event) {
+        const ptone::ControlEntry& entry = controller->noteOn[event.note];
+        // these buttons are not per track and come on the first channel
+        if (entry.trigger >= 0 && event.channel == 0) {
+            processTriggerButtonOn(entry.trigger, messageFrame);
+        }
+        switch (entry.control) {
+            case ptone::CONTROL_TRACK_LED:
+                if (getTrack(entry, event) < CHAN_NUM) {
+                    processTrackLedOn(LED_RECORD + entry.index, getTrack(entry, event));
+                }
+                break;
+            case ptone::CONTROL_BANK_RIGHT:
+                processBtnRightOn();
+                break;
+            case ptone::CONTROL_BANK_LEFT:
+                processBtnLeftOn();
+                break;
+            case ptone::CONTROL_SHIFT:
+                processShiftOn();
+                break;
+            case ptone::CONTROL_SCENE_LAUNCH:
+                processSceneLaunchOn(entry.index);
+                break;
+            case ptone::CONTROL_TAP_TEMPO:
+                processTapTempoOn(messageFrame);
+                break;
+            case ptone::CONTROL_NUDGE_PLUS:
+                tapClock.nudge = CLOCK_NUDGE;
+                break;
+            case ptone::CONTROL_NUDGE_MINUS:
+                tapClock.nudge = -CLOCK_NUDGE;
+                break;
+            case ptone::CONTROL_PLAY:
+                if (looperEnabled) {
+                    looper.play();
+                }
+                break;
+            case ptone::CONTROL_RECORD:
+                if (looperEnabled && isShifted) {
+                    looper.clear();
+                } else if (looperEnabled) {
+                    looper.record();
+                }
+                break;
         }
     }
 
+    // controls of a track come on its channel unless the controller has a note or CC per track
+    uint8_t getTrack(const ptone::ControlEntry& entry, const ptone::DeviceEvent& event) {
+        return entry.track >= 0 ? entry.track : event.channel;
+    }
+
     void processTrackLedOn(uint8_t note, uint8_t channel) {
         uint8_t led = note - LED_RECORD;
         int ledIndex = trackLedIndex(led, channel);
+        if (sequencerMode && note >= LED_CLIP_LAUNCH_1) {
+            processSequencerStep(note - LED_CLIP_LAUNCH_1, channel);
+            return;
+        }
         if (isShifted) {
             trackLedToggle[ledIndex] = !trackLedToggle[ledIndex];
             return;
@@ -299,27 +1116,171 @@ struct Vpc40Module : Module {
         } else {
             trackLedMidiValue[ledIndex] = LED_ON;
         }
-        trackLedUpdated[ledIndex] = true;
+        trackLedUpdated.set(ledIndex);
+        outputUpdate.set(LED_OUTPUT_1 + ledIndex / CHAN_LED_NUM);
+        expanderChanged = true;
     }
 
     void processTrackLedMomentary(int ledIndex) {
         trackLedMidiValue[ledIndex] = LED_ON;
-        trackLedUpdated[ledIndex] = true;
+        trackLedUpdated.set(ledIndex);
+        outputUpdate.set(LED_OUTPUT_1 + ledIndex / CHAN_LED_NUM);
+        expanderChanged = true;
+    }
+
+    void processSequencerStep(int row, uint8_t channel) {
+        if (channel >= CHAN_NUM) return;
+        sequencer.toggle(row, sequencerPage * CHAN_NUM + channel);
+        trackLedUpdated.set(trackLedIndex(LED_CLIP_LAUNCH_1 - LED_RECORD + row, channel));
+        expanderChanged = true;
+    }
+
+    void processSceneLaunchOn(int page) {
+        if (sequencerMode) {
+            sequencerPage = page;
+            gridChanged = true;
+        } else if (morphMode) {
+            if (isShifted) {
+                storeSnapshot(page);
+            } else {
+                morph.select(page);
+            }
+            sceneLedsChanged = true;
+        }
+    }
+
+    void storeSnapshot(int snapshot) {
+        morph.store(snapshot, deviceKnobs.voltage, 0, KNOB_GROUP_SIZE);
+        morph.store(snapshot, trackKnobs.voltage, KNOB_GROUP_SIZE, KNOB_GROUP_SIZE);
+    }
+
+    // sets the knob voltages of all banks to the morph, the smoothers carry them to the outputs
+    void processMorph() {
+        bool morphed = morph.process([&](int i, simd::float_4 v) {
+            if (i < KNOB_GROUP_SIZE) {
+                v.store(&deviceKnobs.voltage[i]);
+            } else {
+                v.store(&trackKnobs.voltage[i - KNOB_GROUP_SIZE]);
+            }
+        });
+        if (!morphed) return;
+        for (int k = 0; k < C_KNOB_NUM; k++) {
+            deviceKnobs.smoothers[k].wakeAll();
+            trackKnobs.smoothers[k].wakeAll();
+        }
+        smoothingActive = true;
+    }
+
+    void setLooperEnabled(bool enabled) {
+        looperEnabled = enabled;
+        // a loop left playing could not be stopped without the buttons
+        if (!enabled) {
+            looperClearRequested = true;
+        }
+    }
+
+    void setMorphMode(bool mode) {
+        morphMode = mode;
+        // a morph that changed while it was off is applied now
+        morph.changed = mode;
+        sceneLedsChanged = true;
+    }
+
+    void processTriggerButtonOn(int button, int64_t messageFrame) {
+        // the trigger is placed on the message's frame rather than the frame it was handled on
+        buttonPulses.trigger(button, std::round(1e-3f / sampleTime), messageFrame - frame);
+        buttonGate[button] = true;
+        outputUpdate.set(BUTTON_GATE_OUTPUT);
+        expanderPresses |= 1 << button;
+        expanderChanged = true;
+    }
+
+    void processTriggerButtonOff(int button) {
+        buttonGate[button] = false;
+        outputUpdate.set(BUTTON_GATE_OUTPUT);
+        expanderChanged = true;
+    }
+
+    void processTapTempoOn(int64_t tapFrame) {
+        if (isShifted) {
+            tapClock.stop();
+            return;
+        }
+        switch (tapClock.tap(tapFrame)) {
+            case ptone::TapClock::TAP_RESTART:
+                clockResetPulse.trigger(1e-3f);
+                clockPulse.trigger(1e-3f);
+                break;
+            case ptone::TapClock::TAP_TICK:
+                clockPulse.trigger(1e-3f);
+                break;
+            case ptone::TapClock::TAP_ALIGNED:
+                break;
+        }
     }
 
     void processBtnRightOn() {
-        bank = bank + 1;
-        if (bank > PORT_MAX_CHANNELS - 1) bank = 0;
-        bankChanged = true;
+        if (bank >= numBanks - 1) {
+            setBank(0);
+        } else {
+            setBank(bank + 1);
+        }
     }
 
     void processBtnLeftOn() {
         if (bank == 0) {
-            bank = PORT_MAX_CHANNELS - 1;
+            setBank(numBanks - 1);
         } else {
-            bank = bank - 1;
+            setBank(bank - 1);
         }
+    }
+
+    void setBank(uint8_t newBank) {
+        bank = newBank;
         bankChanged = true;
+        expanderChanged = true;
+        bankMask.clear();
+        for (int k = 0; k < C_KNOB_NUM; k++) {
+            bankMask.set(knobIndex(k, bank));
+        }
+        if (knobsCurrentBankOnly) {
+            setKnobOutputsUpdate();
+        }
+    }
+
+    void setNumBanks(int count) {
+        numBanks = count;
+        knobOutputsChanged = true;
+    }
+
+    void setKnobsCurrentBankOnly(bool currentBankOnly) {
+        knobsCurrentBankOnly = currentBankOnly;
+        knobOutputsChanged = true;
+    }
+
+    // called on a flush after the banks or the knob output mode changed
+    void applyNumBanks() {
+        if (bank >= numBanks) {
+            setBank(numBanks - 1);
+        }
+        // banks above the count are neither smoothed nor written
+        for (int k = 0; k < C_KNOB_NUM; k++) {
+            deviceKnobs.smoothers[k].setChannels(numBanks);
+            trackKnobs.smoothers[k].setChannels(numBanks);
+        }
+        smoothingActive = true;
+        for (int k = 0; k < C_KNOB_NUM; k++) {
+            setOutputChannels(DEVICE_KNOB_1_OUTPUT + k);
+            setOutputChannels(TRACK_KNOB_1_OUTPUT + k);
+        }
+        setKnobOutputsUpdate();
+    }
+
+    void setKnobOutputsUpdate() {
+        for (int k = 0; k < C_KNOB_NUM; k++) {
+            outputUpdate.set(DEVICE_KNOB_1_OUTPUT + k);
+            outputUpdate.set(TRACK_KNOB_1_OUTPUT + k);
+        }
     }
 
     void processShiftOn() {
@@ -327,238 +1288,534 @@ struct Vpc40Module : Module {
     }
 
 
-    void processNoteOff(Message &msg) {
-        uint8_t note = msg.getNote();
-        if (isTrackLed(note)) {
-            processTrackLedOff(note, msg.getChannel());
-        } else {
-            switch(note) {
-                case BTN_SHIFT:
-                    processShiftOff();
-                    break;
-            }
+    void processNoteOff(const ptone::DeviceEvent& event) {
+        const ptone::ControlEntry& entry = controller->noteOff[event.note];
+        if (entry.trigger >= 0 && event.channel == 0) {
+            processTriggerButtonOff(entry.trigger);
+        }
+        switch (entry.control) {
+            case ptone::CONTROL_TRACK_LED:
+                if (getTrack(entry, event) < CHAN_NUM) {
+                    processTrackLedOff(LED_RECORD + entry.index, getTrack(entry, event));
+                }
+                break;
+            case ptone::CONTROL_SHIFT:
+                processShiftOff();
+                break;
+            case ptone::CONTROL_NUDGE_PLUS:
+            case ptone::CONTROL_NUDGE_MINUS:
+                tapClock.nudge = 0.f;
+                break;
         }
     }
 
     void processTrackLedOff(uint8_t note, uint8_t channel) {
         uint8_t led = note - LED_RECORD;
         int ledIndex = trackLedIndex(led, channel);
+        if (sequencerMode && note >= LED_CLIP_LAUNCH_1) return;
         if (trackLedToggle[ledIndex]) return;
         trackLedMidiValue[ledIndex] = LED_OFF;
-        trackLedUpdated[ledIndex] = true;
+        trackLedUpdated.set(ledIndex);
+        outputUpdate.set(LED_OUTPUT_1 + channel);
+        expanderChanged = true;
     }
 
     void processShiftOff() {
         isShifted = false;
     }
 
-    void processCc(Message &msg) {
-        uint8_t cc = msg.getNote();
-        if (isDeviceKnob(cc)) {
-            processDeviceKnob(cc, msg.getValue());
-        } else if (isTrackKnob(cc)) {
-            processTrackKnob(cc, msg.getValue());
-        } else if (cc == C_TRACK_LEVEL) {
-            processTrackLevel(msg.getChannel(), msg.getValue());
-        } else if (cc == C_MASTER_LEVEL) {
-            processMasterLevel(msg.getValue());
-        } else if (cc == C_CROSSFADER) {
-            processXFaderLevel(msg.getValue());
-        } else if (cc == C_CUE_LEVEL) {
-            processCueLevel(msg.getValue());
+    void processCc(const ptone::DeviceEvent& event) {
+        const ptone::ControlEntry& entry = controller->cc[event.note];
+        switch (entry.control) {
+            case ptone::CONTROL_DEVICE_KNOB:
+                processKnob(deviceKnobs, entry.index, event.value);
+                break;
+            case ptone::CONTROL_TRACK_KNOB:
+                processKnob(trackKnobs, entry.index, event.value);
+                break;
+            case ptone::CONTROL_TRACK_LEVEL:
+                processTrackLevel(getTrack(entry, event), event.value);
+                break;
+            case ptone::CONTROL_MASTER_LEVEL:
+                processMasterLevel(event.value);
+                break;
+            case ptone::CONTROL_CROSSFADER:
+                processXFaderLevel(event.value);
+                break;
+            case ptone::CONTROL_CUE_LEVEL:
+                processCueLevel(event.value);
+                break;
         }
-    }
-
-    void processDeviceKnob(uint8_t cc, uint8_t value) {
-        int knob = cc - C_DEVICE_KNOB_1;
-        int ki = knobIndex(knob, bank);
-        if (isShifted) {
-            processDeviceKnobRingType(ki, value);
-        } else {
-            processDeviceKnobValue(ki, value);
+        if (looper.isCapturing()) {
+            captureControl(entry, event);
         }
     }
 
-    void processDeviceKnobRingType(int knobIndex, uint8_t value) {
-        if (value < deviceKnobMidi[knobIndex]) {
-            switch (deviceKnobRingType[knobIndex]) {
-                case RING_TYPE_SINGLE:
-                    deviceKnobRingType[knobIndex] = RING_TYPE_PAN;
-                    break;
-                case RING_TYPE_VOLUME:
-                    deviceKnobRingType[knobIndex] = RING_TYPE_SINGLE;
-                    break;
-                case RING_TYPE_PAN:
-                    deviceKnobRingType[knobIndex] = RING_TYPE_VOLUME;
-                    break;
-            }
-        } else {
-            switch (deviceKnobRingType[knobIndex]) {
-                case RING_TYPE_SINGLE:
-                    deviceKnobRingType[knobIndex] = RING_TYPE_VOLUME;
-                    break;
-                case RING_TYPE_VOLUME:
-                    deviceKnobRingType[knobIndex] = RING_TYPE_PAN;
-                    break;
-                case RING_TYPE_PAN:
-                    deviceKnobRingType[knobIndex] = RING_TYPE_SINGLE;
-                    break;
-            }
-        }
-        deviceKnobRingTypeUpdate[knobIndex] = true;
-        // we must reset knobValue on the device
-        deviceKnobUpdate[knobIndex] = true;
-    }
-
-    void processDeviceKnobValue(int knobIndex, uint8_t value) {
-        uint8_t oldMidiValue = deviceKnobMidi[knobIndex];
-        uint8_t newMidiValue = value;
-        if(oldMidiValue != newMidiValue) {
-            deviceKnobVoltage[knobIndex] = calculateVoltage(value);; 
-            deviceKnobMidi[knobIndex] = newMidiValue;
-            deviceKnobUpdate[knobIndex] = true;
+    // the looper records the values controls end up with, in the lane of the output they drive
+    void captureControl(const ptone::ControlEntry& entry, const ptone::DeviceEvent& event) {
+        uint8_t track = getTrack(entry, event);
+        switch (entry.control) {
+            case ptone::CONTROL_DEVICE_KNOB:
+                if (!isShifted) {
+                    looper.capture(DEVICE_KNOB_1_OUTPUT + entry.index, bank, event.value);
+                }
+                break;
+            case ptone::CONTROL_TRACK_KNOB:
+                if (!isShifted) {
+                    looper.capture(TRACK_KNOB_1_OUTPUT + entry.index, bank, event.value);
+                }
+                break;
+            case ptone::CONTROL_TRACK_LEVEL:
+                if (track < CHAN_NUM) {
+                    looper.capture(TRACK_LEVEL_1_OUTPUT + track, 0, trackLevelMidi[track]);
+                }
+                break;
+            case ptone::CONTROL_MASTER_LEVEL:
+                looper.capture(MASTER_LEVEL_OUTPUT, 0, masterLevelMidi);
+                break;
+            case ptone::CONTROL_CROSSFADER:
+                looper.capture(X_FADER_OUTPUT, 0, xFaderMidi);
+                break;
+            case ptone::CONTROL_CUE_LEVEL:
+                looper.capture(CUE_OUTPUT, 0, cueMidiValue);
+                break;
         }
     }
 
-    void processTrackKnob(uint8_t cc, uint8_t value) {
-        int knob = cc - C_TRACK_KNOB_1;
+    void processKnob(KnobGroup& knobs, uint8_t knob, uint8_t value) {
         int ki = knobIndex(knob, bank);
         if (isShifted) {
-            processTrackKnobRingType(ki, value);
+            processKnobRingType(knobs, ki, value);
         } else {
-            processTrackKnobValue(ki, value);
+            processKnobValue(knobs, ki, value);
         }
     }
 
-    void processTrackKnobRingType(int knobIndex, uint8_t value) {
-        if (value < trackKnobMidi[knobIndex]) {
-            switch (trackKnobRingType[knobIndex]) {
+    void processKnobRingType(KnobGroup& knobs, int knobIndex, uint8_t value) {
+        if (value < knobs.midi[knobIndex]) {
+            switch (knobs.ringType[knobIndex]) {
                 case RING_TYPE_SINGLE:
-                    trackKnobRingType[knobIndex] = RING_TYPE_PAN;
+                    knobs.ringType[knobIndex] = RING_TYPE_PAN;
                     break;
                 case RING_TYPE_VOLUME:
-                    trackKnobRingType[knobIndex] = RING_TYPE_SINGLE;
+                    knobs.ringType[knobIndex] = RING_TYPE_SINGLE;
                     break;
                 case RING_TYPE_PAN:
-                    trackKnobRingType[knobIndex] = RING_TYPE_VOLUME;
+                    knobs.ringType[knobIndex] = RING_TYPE_VOLUME;
                     break;
             }
         } else {
-            switch (trackKnobRingType[knobIndex]) {
+            switch (knobs.ringType[knobIndex]) {
                 case RING_TYPE_SINGLE:
-                    trackKnobRingType[knobIndex] = RING_TYPE_VOLUME;
+                    knobs.ringType[knobIndex] = RING_TYPE_VOLUME;
                     break;
                 case RING_TYPE_VOLUME:
-                    trackKnobRingType[knobIndex] = RING_TYPE_PAN;
+                    knobs.ringType[knobIndex] = RING_TYPE_PAN;
                     break;
                 case RING_TYPE_PAN:
-                    trackKnobRingType[knobIndex] = RING_TYPE_SINGLE;
+                    knobs.ringType[knobIndex] = RING_TYPE_SINGLE;
                     break;
             }
         }
-        trackKnobRingTypeUpdate[knobIndex] = true;
-        // we must reset knobValue on the track
-        trackKnobUpdate[knobIndex] = true;
+        knobs.ringTypeUpdate.set(knobIndex);
+        // we must reset knobValue on the device
+        knobs.valueUpdate.set(knobIndex);
     }
 
-    void processTrackKnobValue(int knobIndex, uint8_t value) {
-        uint8_t oldMidiValue = trackKnobMidi[knobIndex];
+    void processKnobValue(KnobGroup& knobs, int knobIndex, uint8_t value) {
+        uint8_t oldMidiValue = knobs.midi[knobIndex];
         uint8_t newMidiValue = value;
         if(oldMidiValue != newMidiValue) {
-            trackKnobVoltage[knobIndex] = calculateVoltage(value);
-            trackKnobMidi[knobIndex] = newMidiValue;
-            trackKnobUpdate[knobIndex] = true;
+            knobs.voltage[knobIndex] = calculateVoltage(knobs.outputGroup, value);
+            knobs.midi[knobIndex] = newMidiValue;
+            knobs.valueUpdate.set(knobIndex);
+            moveSmoother(knobs.smoothers[knobIndex / PORT_MAX_CHANNELS], knobIndex % PORT_MAX_CHANNELS, knobs.voltage[knobIndex]);
         }
     }
 
     void processTrackLevel(uint8_t channel, uint8_t value) {
         uint8_t track = channel;
-        trackLevelVoltage[track] = calculateVoltage(value);
+        if (track >= CHAN_NUM) return;
+        trackLevelMidi[track] = value;
+        trackLevelVoltage[track] = calculateVoltage(TRACK_LEVEL_GROUP, value);
+        moveSmoother(trackLevelSmoother, track, trackLevelVoltage[track]);
     }
 
     void processMasterLevel(uint8_t value) {
-        masterLevelVoltage = calculateVoltage(value);
+        masterLevelMidi = value;
+        masterLevelVoltage = calculateVoltage(MASTER_GROUP, value);
+        moveSmoother(masterSmoother, 0, masterLevelVoltage);
     }
 
     void processXFaderLevel(uint8_t value) {
-        xFaderVoltage = calculateVoltage(value);
+        xFaderMidi = value;
+        xFaderVoltage = calculateVoltage(MASTER_GROUP, value);
+        moveSmoother(masterSmoother, 1, xFaderVoltage);
+        morph.setPosition(value / 127.f);
     }
 
+    // the cue knob is relative
     void processCueLevel(uint8_t value) {
         if (value > 0 && value <= 0x3F && cueMidiValue < 127) {
             uint8_t availableDelta = 127 - cueMidiValue;
             if (value < availableDelta) {
-                cueMidiValue += value;
+                setCueLevel(cueMidiValue + value);
             } else {
-                cueMidiValue = 127;
+                setCueLevel(127);
             }
-            cueVoltage = calculateVoltage(cueMidiValue);
         } else if (value >= 0x40 && value <= 0x7F && cueMidiValue > 0) {
             uint8_t normalizedDelta = 0x80 - value;
             if (normalizedDelta < cueMidiValue) {
-                cueMidiValue -= normalizedDelta;
+                setCueLevel(cueMidiValue - normalizedDelta);
             } else {
-                cueMidiValue = 0;
+                setCueLevel(0);
             }
-            cueVoltage = calculateVoltage(cueMidiValue);
         }
     }
 
+    void setCueLevel(uint8_t value) {
+        cueMidiValue = value;
+        cueVoltage = calculateVoltage(MASTER_GROUP, cueMidiValue);
+        moveSmoother(masterSmoother, 2, cueVoltage);
+    }
+
+    template <int CHANNELS>
+    void moveSmoother(ptone::PolySmoother<CHANNELS>& smoother, int channel, float target) {
+        if (jitterCompensation) {
+            // arrives when the next message is due, between 1 ms and 50 ms
+            smoother.ramp(channel, target, messageFrame, 1e-3f / sampleTime, 50e-3f / sampleTime);
+        } else {
+            smoother.wake(channel);
+        }
+        smoothingActive = true;
+    }
+
     int knobIndex(uint8_t knob, uint8_t bank) {
         return knob * PORT_MAX_CHANNELS + bank;
     }
 
-    bool isDeviceKnob(uint8_t cc) {
-        return cc >= C_DEVICE_KNOB_1 && cc <= C_DEVICE_KNOB_8;
+    int trackLedIndex(uint8_t note, uint8_t channel) {
+        return channel * CHAN_LED_NUM + note;
     }
 
-    bool isTrackKnob(uint8_t cc) {
-        return cc >= C_TRACK_KNOB_1 && cc <= C_TRACK_KNOB_8;
+    float calculateVoltage(int outputGroup, uint8_t midiValue) {
+        return ptone::midiToVoltage(outputCurve[outputGroup], midiValue);
     }
 
-    bool isTrackLed(uint8_t note) {
-        return note >= LED_RECORD && note <= LED_CLIP_LAUNCH_5;
+    void setCurve(int outputGroup, int curve) {
+        // applied by the next flush on the engine thread
+        outputCurve[outputGroup] = curve;
+        curvesChanged = true;
     }
 
-    int trackLedIndex(uint8_t note, uint8_t channel) {
-        return channel * CHAN_LED_NUM + note;
+    // recomputes every voltage from its MIDI value
+    void applyCurves() {
+        applyKnobCurve(deviceKnobs);
+        applyKnobCurve(trackKnobs);
+        // the knob voltages were rebuilt from the knobs, a morph is applied over them again
+        morph.changed |= morphMode;
+        for (int t = 0; t < CHAN_NUM; t++) {
+            trackLevelVoltage[t] = calculateVoltage(TRACK_LEVEL_GROUP, trackLevelMidi[t]);
+        }
+        masterLevelVoltage = calculateVoltage(MASTER_GROUP, masterLevelMidi);
+        xFaderVoltage = calculateVoltage(MASTER_GROUP, xFaderMidi);
+        cueVoltage = calculateVoltage(MASTER_GROUP, cueMidiValue);
+        trackLevelSmoother.wakeAll();
+        masterSmoother.wakeAll();
+        smoothingActive = true;
     }
 
-    float calculateVoltage(uint8_t midiValue) {
-        return 10.f * clamp(midiValue / 127.f, 0.f, 1.f);
+    void applyKnobCurve(KnobGroup& knobs) {
+        for (int ki = 0; ki < KNOB_GROUP_SIZE; ki++) {
+            knobs.voltage[ki] = calculateVoltage(knobs.outputGroup, knobs.midi[ki]);
+        }
+        for (int k = 0; k < C_KNOB_NUM; k++) {
+            knobs.smoothers[k].wakeAll();
+        }
     }
 
-    void setCc(int64_t frame, uint8_t midiChannel, uint8_t cc, uint8_t value) {
-        Message msg;
-        msg.setFrame(frame);
-        msg.setChannel(midiChannel);
-        msg.setNote(cc);
-        msg.setStatus(STATUS_CC);
-        msg.setValue(value);
-        midiOutput.sendMessage(msg);
+    // byte arrays are stored as base64 strings, which keeps large patches small and fast to load
+    void bytesToJson(json_t* rootJ, const char* key, const uint8_t* bytes, size_t size) {
+        json_object_set_new(rootJ, key, json_string(string::toBase64(bytes, size).c_str()));
     }
 
-    void setLedOn(int64_t frame, uint8_t midiChannel, uint8_t note) {
-        setLedOn(frame, midiChannel, note, LED_ON);
+    bool bytesFromJson(json_t* rootJ, const char* key, uint8_t* bytes, size_t size) {
+        const char* base64 = json_string_value(json_object_get(rootJ, key));
+        if (!base64) return false;
+        std::vector<uint8_t> data = string::fromBase64(base64);
+        if (data.size() != size) return false;
+        std::copy(data.begin(), data.end(), bytes);
+        return true;
     }
 
-    void setLedOff(int64_t frame, uint8_t midiChannel, uint8_t note) {
-        Message msg;
-        msg.setFrame(frame);
-        msg.setChannel(midiChannel);
-        msg.setNote(note);
-        msg.setStatus(STATUS_NOTE_OFF);
-        msg.setValue(0);
-        midiOutput.sendMessage(msg);
-    }
-    void setLedOn(int64_t frame, uint8_t midiChannel, uint8_t note, uint8_t ledValue) {
-        Message msg;
-        msg.setFrame(frame);
-        msg.setChannel(midiChannel);
-        msg.setNote(note);
-        msg.setStatus(STATUS_NOTE_ON);
-        msg.setValue(ledValue);
-        midiOutput.sendMessage(msg);
+    json_t* dataToJson() override {
+        json_t* rootJ = json_object();
+        json_object_set_new(rootJ, "midiInput", midiInput.toJson());
+        json_object_set_new(rootJ, "midiOutput", midiOutput.toJson());
+
+        json_t* curvesJ = json_array();
+        json_t* smoothingJ = json_array();
+        for (int g = 0; g < NUM_OUTPUT_GROUPS; g++) {
+            json_array_append_new(curvesJ, json_integer(outputCurve[g]));
+            json_array_append_new(smoothingJ, json_boolean(smoothing[g]));
+        }
+        json_object_set_new(rootJ, "outputCurves", curvesJ);
+        json_object_set_new(rootJ, "smoothing", smoothingJ);
+        json_object_set_new(rootJ, "smoothingTime", json_real(smoothingTime));
+        json_object_set_new(rootJ, "flushBudget", json_integer(flushBudget));
+        json_object_set_new(rootJ, "inboundLatency", json_real(inboundLatency));
+        json_object_set_new(rootJ, "jitterCompensation", json_boolean(jitterCompensation));
+
+        json_object_set_new(rootJ, "numBanks", json_integer(numBanks));
+        json_object_set_new(rootJ, "knobsCurrentBankOnly", json_boolean(knobsCurrentBankOnly));
+        json_object_set_new(rootJ, "bank", json_integer(bank));
+        bytesToJson(rootJ, "deviceKnobs", deviceKnobs.midi, KNOB_GROUP_SIZE);
+        bytesToJson(rootJ, "deviceKnobRingTypes", deviceKnobs.ringType, KNOB_GROUP_SIZE);
+        bytesToJson(rootJ, "trackKnobs", trackKnobs.midi, KNOB_GROUP_SIZE);
+        bytesToJson(rootJ, "trackKnobRingTypes", trackKnobs.ringType, KNOB_GROUP_SIZE);
+        bytesToJson(rootJ, "trackLevels", trackLevelMidi, CHAN_NUM);
+        bytesToJson(rootJ, "crossfadeSides", crossfadeSide, CHAN_NUM);
+        json_object_set_new(rootJ, "masterLevel", json_integer(masterLevelMidi));
+        json_object_set_new(rootJ, "xFader", json_integer(xFaderMidi));
+        json_object_set_new(rootJ, "cue", json_integer(cueMidiValue));
+
+        uint8_t ledToggle[CHAN_LED_NUM * CHAN_NUM];
+        std::copy(trackLedToggle, trackLedToggle + CHAN_LED_NUM * CHAN_NUM, ledToggle);
+        bytesToJson(rootJ, "trackLedToggles", ledToggle, CHAN_LED_NUM * CHAN_NUM);
+        bytesToJson(rootJ, "trackLeds", trackLedMidiValue, CHAN_LED_NUM * CHAN_NUM);
+
+        json_object_set_new(rootJ, "sequencerMode", json_boolean(sequencerMode));
+        json_object_set_new(rootJ, "sequenceLength", json_integer(sequencer.length));
+        json_object_set_new(rootJ, "sequencerPage", json_integer(sequencerPage));
+        // each track's steps as a little-endian word
+        uint8_t pattern[SEQ_ROWS * 8];
+        for (int i = 0; i < SEQ_ROWS * 8; i++) {
+            pattern[i] = sequencer.pattern[i / 8] >> (8 * (i % 8));
+        }
+        bytesToJson(rootJ, "sequencerPattern", pattern, SEQ_ROWS * 8);
+
+        json_object_set_new(rootJ, "morphMode", json_boolean(morphMode));
+        json_object_set_new(rootJ, "looper", json_boolean(looperEnabled));
+        json_object_set_new(rootJ, "morphStored", json_integer(morph.storedMask));
+        json_object_set_new(rootJ, "morphA", json_integer(morph.a));
+        json_object_set_new(rootJ, "morphB", json_integer(morph.b));
+        bytesToJson(rootJ, "morphSnapshots", (const uint8_t*) morph.voltage, sizeof(morph.voltage));
+
+        json_object_set_new(rootJ, "clockBpm", json_real(tapClock.bpm));
+        json_object_set_new(rootJ, "clockPpqn", json_integer(tapClock.ppqn));
+        json_object_set_new(rootJ, "clockRunning", json_boolean(tapClock.running));
+        return rootJ;
+    }
+
+    void dataFromJson(json_t* rootJ) override {
+        json_t* midiInputJ = json_object_get(rootJ, "midiInput");
+        if (midiInputJ) {
+            midiInput.fromJson(midiInputJ);
+        }
+        json_t* midiOutputJ = json_object_get(rootJ, "midiOutput");
+        if (midiOutputJ) {
+            midiOutput.fromJson(midiOutputJ);
+        }
+
+        json_t* curvesJ = json_object_get(rootJ, "outputCurves");
+        json_t* smoothingJ = json_object_get(rootJ, "smoothing");
+        for (int g = 0; g < NUM_OUTPUT_GROUPS; g++) {
+            json_t* curveJ = json_array_get(curvesJ, g);
+            if (curveJ) {
+                setCurve(g, clamp((int) json_integer_value(curveJ), 0, ptone::NUM_CURVES - 1));
+            }
+            json_t* groupSmoothingJ = json_array_get(smoothingJ, g);
+            if (groupSmoothingJ) {
+                smoothing[g] = json_is_true(groupSmoothingJ);
+            }
+        }
+        json_t* smoothingTimeJ = json_object_get(rootJ, "smoothingTime");
+        if (smoothingTimeJ) {
+            setSmoothingTime(clamp((float) json_number_value(smoothingTimeJ), 0.0001f, 10.f));
+        }
+        json_t* flushBudgetJ = json_object_get(rootJ, "flushBudget");
+        if (flushBudgetJ) {
+            flushBudget = std::max(1, (int) json_integer_value(flushBudgetJ));
+        }
+        json_t* inboundLatencyJ = json_object_get(rootJ, "inboundLatency");
+        if (inboundLatencyJ) {
+            setInboundLatency(clamp((float) json_number_value(inboundLatencyJ), 0.f, 0.1f));
+        }
+        json_t* jitterCompensationJ = json_object_get(rootJ, "jitterCompensation");
+        if (jitterCompensationJ) {
+            jitterCompensation = json_is_true(jitterCompensationJ);
+        }
+
+        json_t* numBanksJ = json_object_get(rootJ, "numBanks");
+        if (numBanksJ) {
+            setNumBanks(clamp((int) json_integer_value(numBanksJ), 1, PORT_MAX_CHANNELS));
+        }
+        json_t* knobsCurrentBankOnlyJ = json_object_get(rootJ, "knobsCurrentBankOnly");
+        if (knobsCurrentBankOnlyJ) {
+            setKnobsCurrentBankOnly(json_is_true(knobsCurrentBankOnlyJ));
+        }
+        json_t* bankJ = json_object_get(rootJ, "bank");
+        if (bankJ) {
+            setBank(clamp((int) json_integer_value(bankJ), 0, numBanks - 1));
+        }
+        knobsFromJson(rootJ, "deviceKnobs", "deviceKnobRingTypes", deviceKnobs);
+        knobsFromJson(rootJ, "trackKnobs", "trackKnobRingTypes", trackKnobs);
+        if (bytesFromJson(rootJ, "trackLevels", trackLevelMidi, CHAN_NUM)) {
+            for (int t = 0; t < CHAN_NUM; t++) {
+                trackLevelMidi[t] &= 0x7F;
+            }
+        }
+        if (bytesFromJson(rootJ, "crossfadeSides", crossfadeSide, CHAN_NUM)) {
+            for (int t = 0; t < CHAN_NUM; t++) {
+                crossfadeSide[t] = std::min<int>(crossfadeSide[t], NUM_XFADE_SIDES - 1);
+            }
+        }
+        json_t* masterLevelJ = json_object_get(rootJ, "masterLevel");
+        if (masterLevelJ) {
+            masterLevelMidi = json_integer_value(masterLevelJ) & 0x7F;
+        }
+        json_t* xFaderJ = json_object_get(rootJ, "xFader");
+        if (xFaderJ) {
+            xFaderMidi = json_integer_value(xFaderJ) & 0x7F;
+            morph.setPosition(xFaderMidi / 127.f);
+        }
+        json_t* cueJ = json_object_get(rootJ, "cue");
+        if (cueJ) {
+            cueMidiValue = json_integer_value(cueJ) & 0x7F;
+        }
+
+        uint8_t ledToggle[CHAN_LED_NUM * CHAN_NUM];
+        uint8_t ledValue[CHAN_LED_NUM * CHAN_NUM];
+        if (bytesFromJson(rootJ, "trackLedToggles", ledToggle, CHAN_LED_NUM * CHAN_NUM) &&
+                bytesFromJson(rootJ, "trackLeds", ledValue, CHAN_LED_NUM * CHAN_NUM)) {
+            for (int i = 0; i < CHAN_LED_NUM * CHAN_NUM; i++) {
+                trackLedToggle[i] = ledToggle[i];
+                // momentary LEDs are lit only while their button is held
+                trackLedMidiValue[i] = (trackLedToggle[i] && ledValue[i] == LED_ON) ? LED_ON : LED_OFF;
+            }
+            outputUpdate.setAll();
+        }
+
+        json_t* sequencerModeJ = json_object_get(rootJ, "sequencerMode");
+        if (sequencerModeJ) {
+            setSequencerMode(json_is_true(sequencerModeJ));
+        }
+        json_t* sequenceLengthJ = json_object_get(rootJ, "sequenceLength");
+        if (sequenceLengthJ) {
+            setSequenceLength(json_integer_value(sequenceLengthJ));
+        }
+        json_t* sequencerPageJ = json_object_get(rootJ, "sequencerPage");
+        if (sequencerPageJ) {
+            sequencerPage = clamp((int) json_integer_value(sequencerPageJ), 0, SEQ_PAGES - 1);
+        }
+        uint8_t pattern[SEQ_ROWS * 8];
+        if (bytesFromJson(rootJ, "sequencerPattern", pattern, SEQ_ROWS * 8)) {
+            sequencer.clear();
+            for (int i = 0; i < SEQ_ROWS * 8; i++) {
+                sequencer.pattern[i / 8] |= uint64_t(pattern[i]) << (8 * (i % 8));
+            }
+        }
+
+        // snapshots are native floats
+        if (bytesFromJson(rootJ, "morphSnapshots", (uint8_t*) morph.voltage, sizeof(morph.voltage))) {
+            morph.clear();
+            morph.storedMask = json_integer_value(json_object_get(rootJ, "morphStored")) & ((1 << MORPH_SNAPSHOTS) - 1);
+            json_t* morphAJ = json_object_get(rootJ, "morphA");
+            json_t* morphBJ = json_object_get(rootJ, "morphB");
+            if (morphAJ && morphBJ) {
+                morph.a = clamp((int) json_integer_value(morphAJ), -1, MORPH_SNAPSHOTS - 1);
+                morph.b = clamp((int) json_integer_value(morphBJ), -1, MORPH_SNAPSHOTS - 1);
+            }
+        }
+        json_t* looperJ = json_object_get(rootJ, "looper");
+        if (looperJ) {
+            looperEnabled = json_is_true(looperJ);
+        }
+        json_t* morphModeJ = json_object_get(rootJ, "morphMode");
+        if (morphModeJ) {
+            setMorphMode(json_is_true(morphModeJ));
+        }
+
+        json_t* clockBpmJ = json_object_get(rootJ, "clockBpm");
+        if (clockBpmJ) {
+            tapClock.setBpm(clamp((float) json_number_value(clockBpmJ), 30.f, 300.f));
+        }
+        json_t* clockPpqnJ = json_object_get(rootJ, "clockPpqn");
+        if (clockPpqnJ) {
+            tapClock.setPpqn(clamp((int) json_integer_value(clockPpqnJ), 1, 96));
+        }
+        json_t* clockRunningJ = json_object_get(rootJ, "clockRunning");
+        if (clockRunningJ) {
+            tapClock.running = json_is_true(clockRunningJ);
+        }
+
+        // voltages follow from the restored MIDI values, and the device gets everything in budgeted flushes
+        curvesChanged = true;
+        expanderChanged = true;
+        resync();
+        updateHub();
+    }
+
+    void knobsFromJson(json_t* rootJ, const char* valuesKey, const char* ringTypesKey, KnobGroup& knobs) {
+        if (bytesFromJson(rootJ, valuesKey, knobs.midi, KNOB_GROUP_SIZE)) {
+            for (int ki = 0; ki < KNOB_GROUP_SIZE; ki++) {
+                knobs.midi[ki] &= 0x7F;
+            }
+            knobs.valueUpdate.setAll();
+        }
+        if (bytesFromJson(rootJ, ringTypesKey, knobs.ringType, KNOB_GROUP_SIZE)) {
+            for (int ki = 0; ki < KNOB_GROUP_SIZE; ki++) {
+                if (knobs.ringType[ki] < RING_TYPE_SINGLE || knobs.ringType[ki] > RING_TYPE_PAN) {
+                    knobs.ringType[ki] = RING_TYPE_SINGLE;
+                }
+            }
+            knobs.ringTypeUpdate.setAll();
+        }
+    }
+
+    // outbound CCs and LED notes are queued and sent by the rate-limited flush,
+    // the queue drops those the device already shows
+    // they are addressed as on the APC40 and routed to the connected model
+    bool setCc(int priority, uint8_t midiChannel, uint8_t cc, uint8_t value) {
+        if (!controller->ccs[cc]) return false;
+        return outQueue.push(priority, STATUS_CC, midiChannel, cc, value);
+    }
+
+    void setLedOn(uint8_t midiChannel, uint8_t note) {
+        setLedOn(midiChannel, note, LED_ON);
+    }
+
+    void setLedOff(uint8_t midiChannel, uint8_t note) {
+        setLed(STATUS_NOTE_OFF, midiChannel, note, 0);
+    }
+    void setLedOn(uint8_t midiChannel, uint8_t note, uint8_t ledValue) {
+        setLed(STATUS_NOTE_ON, midiChannel, note, ledValue);
+    }
+
+    void setLed(uint8_t status, uint8_t midiChannel, uint8_t note, uint8_t ledValue) {
+        const ptone::LedRoute& route = controller->leds[note];
+        if (route.kind == ptone::ROUTE_NONE) return;
+        if (route.kind == ptone::ROUTE_TRACK_NOTES) {
+            note = route.note + midiChannel;
+            midiChannel = 0;
+        } else {
+            note = route.note;
+        }
+        if (!route.rgb) {
+            outQueue.push(ptone::LED_PRIORITY, status, midiChannel, note, ledValue);
+            return;
+        }
+        // an RGB pad blinks between the color on its blink channel and the one on the first channel,
+        // a message on the first channel stops the blinking, so the blink channel is sent again afterwards
+        const ptone::LedColor& color = controller->colors[ledValue];
+        if (status == STATUS_NOTE_ON && color.channel != 0) {
+            outQueue.push(ptone::LED_PRIORITY, STATUS_NOTE_ON, 0, note, 0);
+            outQueue.push(ptone::LED_PRIORITY, STATUS_NOTE_ON, color.channel, note, color.velocity);
+        } else {
+            outQueue.push(ptone::LED_PRIORITY, status, 0, note, color.velocity);
+            // a blink still queued would start blinking again after the steady color
+            outQueue.cancel(STATUS_NOTE_ON, ptone::Apc40Mk2::BLINK_CHANNEL, note);
+        }
     }
     void inquireDevice() {
         Message msg;
@@ -569,22 +1826,33 @@ struct Vpc40Module : Module {
         msg.bytes[3] = 0x06;
         msg.bytes[4] = 0x01;
         msg.bytes[5] = 0xF7;
-        midiOutput.sendMessage(msg);
+        sendMessage(msg);
+    }
+
+    void processInquireResponse(const ptone::DeviceEvent& event) {
+        sysExDeviceId = event.value;
+        const ptone::ControllerProfile* detected = &ptone::controllerProfile(event.note);
+        if (detected != controller) {
+            // queued messages are routed for the previous model, the resync queues them again
+            outQueue.clear();
+            controller = detected;
+        }
     }
 
-    void processInquireResponse(Message& msg) {
-        //todo: fix the midi button
-        midiOutput.setChannel(-1);
-        sysExDeviceId = msg.bytes[13];
+    void sendMessage(const Message& msg) {
+        if (hub) {
+            hub->sendMessage(hubSubscriber, msg);
+        }
     }
 
     void introduce() {
+        if (!controller->introduced) return;
         Message msg;
         msg.setSize(12);
         msg.bytes[0] = 0xF0;
         msg.bytes[1] = 0x47;
         msg.bytes[2] = sysExDeviceId;
-        msg.bytes[3] = 0x73;
+        msg.bytes[3] = controller->modelId;
         msg.bytes[4] = 0x60;
         msg.bytes[5] = 0x00;
         msg.bytes[6] = 0x04;
@@ -593,39 +1861,54 @@ struct Vpc40Module : Module {
         msg.bytes[9] = 0x01;
         msg.bytes[10] = 0x00;
         msg.bytes[11] = 0xF7;
-        midiOutput.sendMessage(msg);
+        sendMessage(msg);
     }
 
 	void onPortChange(const PortChangeEvent& e) override {
         if (e.connecting && e.type == rack::engine::Port::OUTPUT) {
-            if (e.portId >= LED_OUTPUT_1 && e.portId <= LED_OUTPUT_8) {
-                outputs[e.portId].channels = CHAN_LED_NUM;
-            } else if (e.portId >= DEVICE_KNOB_1_OUTPUT && e.portId <= DEVICE_KNOB_8_OUTPUT) {
-                outputs[e.portId].channels = PORT_MAX_CHANNELS;
-            } else if (e.portId >= TRACK_KNOB_1_OUTPUT && e.portId <= TRACK_KNOB_8_OUTPUT) {
-                outputs[e.portId].channels = PORT_MAX_CHANNELS;
-            }
+            setOutputChannels(e.portId);
+            outputUpdate.set(e.portId);
         }
     }
 
-    void reset() {
-        bank = 0;
-        bankChanged = true;
-        for (int k = 0; k < C_KNOB_NUM; k++) {
-            for (int c = 0; c < PORT_MAX_CHANNELS; c++) {
-                int ki = knobIndex(k, c);
-                trackKnobVoltage[ki] = 0.f;
-                trackKnobMidi[ki] = 0;
-                trackKnobUpdate[ki] = true;
-                trackKnobRingType[ki] = RING_TYPE_SINGLE;
-                trackKnobRingTypeUpdate[ki] = true;
-                deviceKnobVoltage[ki] = 0.f;
-                deviceKnobMidi[ki] = 0;
-                deviceKnobUpdate[ki] = true;
-                deviceKnobRingType[ki] = RING_TYPE_SINGLE;
-                deviceKnobRingTypeUpdate[ki] = true;
+    void onUnBypass(const UnBypassEvent& e) override {
+        // the engine zeroes the outputs and drops them to one channel while bypassed
+        for (int i = 0; i < NUM_OUTPUTS; i++) {
+            if (outputs[i].isConnected()) {
+                setOutputChannels(i);
             }
         }
+        outputUpdate.setAll();
+    }
+
+    void setOutputChannels(int outputId) {
+        if (outputId >= LED_OUTPUT_1 && outputId <= LED_OUTPUT_8) {
+            outputs[outputId].channels = CHAN_LED_NUM;
+        } else if (outputId >= DEVICE_KNOB_1_OUTPUT && outputId <= DEVICE_KNOB_8_OUTPUT) {
+            outputs[outputId].channels = knobsCurrentBankOnly ? 1 : numBanks;
+        } else if (outputId >= TRACK_KNOB_1_OUTPUT && outputId <= TRACK_KNOB_8_OUTPUT) {
+            outputs[outputId].channels = knobsCurrentBankOnly ? 1 : numBanks;
+        } else if (outputId == SEQ_GATE_OUTPUT) {
+            outputs[outputId].channels = SEQ_ROWS;
+        } else if (outputId == BUTTON_TRIGGER_OUTPUT || outputId == BUTTON_GATE_OUTPUT) {
+            outputs[outputId].channels = ptone::NUM_TRIGGER_BUTTONS;
+        }
+    }
+
+    // sends the whole visible state again, regardless of what the device was sent before
+    void resync() {
+        outQueue.invalidate();
+        bankChanged = true;
+        trackLedUpdated.setAll();
+        sceneLedsChanged = true;
+    }
+
+    void reset() {
+        setBank(0);
+        trackKnobs.reset();
+        deviceKnobs.reset();
+        // the curve may not map MIDI 0 to 0 V
+        applyCurves();
     }
 
     void testMidi(const ProcessArgs& args) {
@@ -635,7 +1918,8 @@ struct Vpc40Module : Module {
         msg.setChannel(0);
         msg.setNote(LED_RECORD);
         msg.setValue(LED_ON);
-        midiOutput.sendMessage(msg);
+        sendMessage(msg);
+        outQueue.forget(STATUS_NOTE_ON, 0, LED_RECORD);
     }
 
     void testLedRingType(const ProcessArgs& args) {
@@ -644,7 +1928,8 @@ struct Vpc40Module : Module {
         msg.setStatus(0x0B);
         msg.setNote(C_DEVICE_KNOB_RING_TYPE_1);
         msg.setValue(RING_TYPE_PAN);
-        midiOutput.sendMessage(msg);
+        sendMessage(msg);
+        outQueue.forget(STATUS_CC, 0, C_DEVICE_KNOB_RING_TYPE_1);
     }
     void testLedRing(const ProcessArgs& args) {
         Message msg;
@@ -652,10 +1937,27 @@ struct Vpc40Module : Module {
         msg.setStatus(0x0B);
         msg.setNote(C_DEVICE_KNOB_1);
         msg.setValue(64);
-        midiOutput.sendMessage(msg);
+        sendMessage(msg);
+        outQueue.forget(STATUS_CC, 0, C_DEVICE_KNOB_1);
     }
 };
 
+#ifdef VPC40_PROFILE
+const char* const Vpc40Module::PROFILE_PHASE_NAMES[] = {"MIDI drain", "Dispatch", "Clock and sequencer", "Flush", "Outputs", "Mixer"};
+static_assert(sizeof(Vpc40Module::PROFILE_PHASE_NAMES) / sizeof(Vpc40Module::PROFILE_PHASE_NAMES[0]) == Vpc40Module::NUM_PROFILE_PHASES,
+    "every profile phase needs a name");
+#endif
+
+static const std::vector<int> FLUSH_BUDGETS = {2, 4, 8, 16, 32, 64};
+static const std::vector<float> SMOOTHING_TIMES = {0.001f, 0.005f, 0.01f, 0.02f, 0.05f, 0.1f, 0.2f};
+static const std::vector<float> INBOUND_LATENCIES = {0.f, 0.001f, 0.002f, 0.005f, 0.01f, 0.02f};
+static const std::vector<std::string> CURVE_LABELS = {"0 V to 10 V", "-5 V to 5 V", "Audio taper", "1 V/oct semitones"};
+static const std::vector<std::string> GRID_MODE_LABELS = {"Track LEDs", "Step sequencer"};
+static const std::vector<std::string> XFADE_SIDE_LABELS = {"Through", "A", "B"};
+static const std::vector<int> SEQUENCE_LENGTHS = {8, 16, 24, 32, 40};
+static const std::vector<int> CLOCK_PPQNS = {1, 2, 4, 8, 24};
+static const std::vector<std::string> OUTPUT_GROUP_LABELS = {"Device knobs", "Track knobs", "Track levels", "Master, x-fader and cue"};
+
 struct Vpc40Widget : ModuleWidget {
     Vpc40Widget(Vpc40Module* module) {
         setModule(module);
@@ -691,6 +1993,237 @@ struct Vpc40Widget : ModuleWidget {
         addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(110, 80)), module, Vpc40Module::MASTER_LEVEL_OUTPUT));
         addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(130, 80)), module, Vpc40Module::X_FADER_OUTPUT));
         addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(150, 80)), module, Vpc40Module::CUE_OUTPUT));
+        addInput(createInputCentered<ThemedPJ301MPort>(mm2px(Vec(110, 100)), module, Vpc40Module::CLOCK_INPUT));
+        addInput(createInputCentered<ThemedPJ301MPort>(mm2px(Vec(130, 100)), module, Vpc40Module::SEQ_RESET_INPUT));
+        addInput(createInputCentered<ThemedPJ301MPort>(mm2px(Vec(130, 15)), module, Vpc40Module::TRACK_RING_INPUT));
+        addInput(createInputCentered<ThemedPJ301MPort>(mm2px(Vec(130, 45)), module, Vpc40Module::DEVICE_RING_INPUT));
+        for (int i = 0; i < SEQ_ROWS; i++) {
+            addInput(createInputCentered<ThemedPJ301MPort>(mm2px(Vec(6.604 + 10.838 * i, 85)), module, Vpc40Module::CLIP_ROW_1_INPUT + i));
+        }
+        addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(150, 100)), module, Vpc40Module::SEQ_GATE_OUTPUT));
+        addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(170, 80)), module, Vpc40Module::CLOCK_OUTPUT));
+        addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(170, 100)), module, Vpc40Module::CLOCK_RESET_OUTPUT));
+        addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(183, 80)), module, Vpc40Module::BUTTON_TRIGGER_OUTPUT));
+        addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(183, 100)), module, Vpc40Module::BUTTON_GATE_OUTPUT));
+        for (int i = 0; i < CHAN_NUM; i++) {
+            addInput(createInputCentered<ThemedPJ301MPort>(mm2px(Vec(6.604 + 10.838 * i, 30)), module, Vpc40Module::TRACK_AUDIO_1_INPUT + i));
+        }
+        addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(6.604, 45)), module, Vpc40Module::MIX_OUTPUT));
+        addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(6.604 + 10.838, 45)), module, Vpc40Module::CUE_MIX_OUTPUT));
+    }
+
+    void step() override {
+        Vpc40Module* module = getModule<Vpc40Module>();
+        if (module) {
+            module->updateHub();
+        }
+        ModuleWidget::step();
+    }
+
+    void appendContextMenu(Menu* menu) override {
+        Vpc40Module* module = getModule<Vpc40Module>();
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createMenuLabel(string::f("Controller: %s", module->controller->name)));
+        std::vector<std::string> budgetLabels;
+        for (int budget : FLUSH_BUDGETS) {
+            budgetLabels.push_back(string::f("%d", budget));
+        }
+        menu->addChild(createIndexSubmenuItem("MIDI messages per update", budgetLabels,
+            [=]() {
+                auto it = std::find(FLUSH_BUDGETS.begin(), FLUSH_BUDGETS.end(), module->flushBudget);
+                return it == FLUSH_BUDGETS.end() ? 0 : it - FLUSH_BUDGETS.begin();
+            },
+            [=](size_t i) {
+                module->flushBudget = FLUSH_BUDGETS[i];
+            }
+        ));
+        std::vector<std::string> latencyLabels;
+        for (float latency : INBOUND_LATENCIES) {
+            latencyLabels.push_back(latency == 0.f ? "When received" : string::f("On message frame + %g ms", latency * 1000.f));
+        }
+        menu->addChild(createIndexSubmenuItem("Apply inbound MIDI", latencyLabels,
+            [=]() {
+                auto it = std::find(INBOUND_LATENCIES.begin(), INBOUND_LATENCIES.end(), module->inboundLatency);
+                return it == INBOUND_LATENCIES.end() ? 0 : it - INBOUND_LATENCIES.begin();
+            },
+            [=](size_t i) {
+                module->setInboundLatency(INBOUND_LATENCIES[i]);
+            }
+        ));
+        menu->addChild(createBoolPtrMenuItem("Jitter compensation", "", &module->jitterCompensation));
+        menu->addChild(createSubmenuItem("MIDI statistics", "", [=](Menu* menu) {
+            const ptone::MidiStats& stats = module->stats;
+            float msPerFrame = 1000.f * module->sampleTime;
+            menu->addChild(createMenuLabel(string::f("In: %.0f msg/s, %llu total", stats.inboundRate, (unsigned long long) stats.inboundMessages)));
+            menu->addChild(createMenuLabel(string::f("Out: %.0f msg/s, %llu total", stats.outboundRate, (unsigned long long) stats.outboundMessages)));
+            menu->addChild(createMenuLabel(string::f("Inbound latency: mean %.2f ms, p99 < %.2f ms, max %.2f ms",
+                stats.inboundLatency.mean() * msPerFrame, stats.inboundLatency.quantile(0.99f) * msPerFrame, stats.inboundLatency.max * msPerFrame)));
+            menu->addChild(createMenuLabel(string::f("Flush size: mean %.1f, max %u", stats.flushSize.mean(), stats.flushSize.max)));
+            menu->addChild(createMenuLabel(string::f("Outbound backlog: mean %.1f, max %u", stats.outboundBacklog.mean(), stats.outboundBacklog.max)));
+            menu->addChild(createMenuLabel(string::f("Coalesced %u, suppressed %u, delay overflows %u", module->outQueue.coalesced, module->outQueue.suppressed, stats.delayOverflows)));
+            menu->addChild(createMenuLabel(string::f("Ring overflows: device %u, module %u, sender %u", stats.deviceRingOverflows, stats.moduleRingOverflows, stats.senderOverflows)));
+            menu->addChild(createMenuItem("Reset", "", [=]() {
+                module->statsResetRequested = true;
+            }));
+            menu->addChild(createMenuItem("Export CSV...", "", [=]() {
+                char* path = osdialog_file(OSDIALOG_SAVE, NULL, "vpc40-midi-stats.csv", NULL);
+                if (!path) return;
+                module->exportStats(path);
+                std::free(path);
+            }));
+        }));
+#ifdef VPC40_PROFILE
+        menu->addChild(createSubmenuItem("Profile of process()", "", [=](Menu* menu) {
+            for (int p = 0; p < Vpc40Module::NUM_PROFILE_PHASES; p++) {
+                ptone::PhaseProfiler<Vpc40Module::NUM_PROFILE_PHASES>::Summary s = module->profiler.summarize(p);
+                menu->addChild(createMenuLabel(string::f("%s: min %u, mean %.0f, p99 %u ns", Vpc40Module::PROFILE_PHASE_NAMES[p], s.min, s.mean, s.p99)));
+            }
+            menu->addChild(createMenuItem("Reset", "", [=]() {
+                module->profilerResetRequested = true;
+            }));
+            menu->addChild(createMenuItem("Export CSV...", "", [=]() {
+                char* path = osdialog_file(OSDIALOG_SAVE, NULL, "vpc40-profile.csv", NULL);
+                if (!path) return;
+                module->exportProfile(path);
+                std::free(path);
+            }));
+        }));
+#endif
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createMenuLabel("Response curve"));
+        for (int g = 0; g < Vpc40Module::NUM_OUTPUT_GROUPS; g++) {
+            menu->addChild(createIndexSubmenuItem(OUTPUT_GROUP_LABELS[g], CURVE_LABELS,
+                [=]() {
+                    return module->outputCurve[g];
+                },
+                [=](size_t i) {
+                    module->setCurve(g, i);
+                }
+            ));
+        }
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createMenuLabel("Smoothing"));
+        for (int g = 0; g < Vpc40Module::NUM_OUTPUT_GROUPS; g++) {
+            menu->addChild(createBoolPtrMenuItem(OUTPUT_GROUP_LABELS[g], "", &module->smoothing[g]));
+        }
+        std::vector<std::string> timeLabels;
+        for (float time : SMOOTHING_TIMES) {
+            timeLabels.push_back(string::f("%g ms", time * 1000.f));
+        }
+        menu->addChild(createIndexSubmenuItem("Smoothing time", timeLabels,
+            [=]() {
+                auto it = std::find(SMOOTHING_TIMES.begin(), SMOOTHING_TIMES.end(), module->smoothingTime);
+                return it == SMOOTHING_TIMES.end() ? 0 : it - SMOOTHING_TIMES.begin();
+            },
+            [=](size_t i) {
+                module->setSmoothingTime(SMOOTHING_TIMES[i]);
+            }
+        ));
+
+        menu->addChild(new MenuSeparator);
+        std::vector<std::string> bankLabels;
+        for (int count = 1; count <= PORT_MAX_CHANNELS; count++) {
+            bankLabels.push_back(string::f("%d", count));
+        }
+        menu->addChild(createIndexSubmenuItem("Banks", bankLabels,
+            [=]() {
+                return module->numBanks - 1;
+            },
+            [=](size_t i) {
+                module->setNumBanks(i + 1);
+            }
+        ));
+        menu->addChild(createBoolMenuItem("Knob outputs: current bank only", "",
+            [=]() {
+                return module->knobsCurrentBankOnly;
+            },
+            [=](bool currentBankOnly) {
+                module->setKnobsCurrentBankOnly(currentBankOnly);
+            }
+        ));
+        menu->addChild(createSubmenuItem("Mixer crossfader sides", "", [=](Menu* menu) {
+            for (int t = 0; t < CHAN_NUM; t++) {
+                menu->addChild(createIndexSubmenuItem(string::f("Track %d", t + 1), XFADE_SIDE_LABELS,
+                    [=]() {
+                        return module->crossfadeSide[t];
+                    },
+                    [=](size_t i) {
+                        module->crossfadeSide[t] = i;
+                    }
+                ));
+            }
+        }));
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createIndexSubmenuItem("Clip-launch grid", GRID_MODE_LABELS,
+            [=]() {
+                return module->sequencerMode ? 1 : 0;
+            },
+            [=](size_t i) {
+                module->setSequencerMode(i == 1);
+            }
+        ));
+        std::vector<std::string> lengthLabels;
+        for (int length : SEQUENCE_LENGTHS) {
+            lengthLabels.push_back(string::f("%d steps", length));
+        }
+        menu->addChild(createIndexSubmenuItem("Sequence length", lengthLabels,
+            [=]() {
+                auto it = std::find(SEQUENCE_LENGTHS.begin(), SEQUENCE_LENGTHS.end(), module->sequencer.length);
+                return it == SEQUENCE_LENGTHS.end() ? 0 : it - SEQUENCE_LENGTHS.begin();
+            },
+            [=](size_t i) {
+                module->setSequenceLength(SEQUENCE_LENGTHS[i]);
+            }
+        ));
+        menu->addChild(createBoolMenuItem("Snapshot morph", "Shift+Scene stores",
+            [=]() {
+                return module->morphMode;
+            },
+            [=](bool mode) {
+                module->setMorphMode(mode);
+            }
+        ));
+        menu->addChild(createMenuItem("Clear snapshots", "", [=]() {
+            module->morph.clear();
+            module->sceneLedsChanged = true;
+        }));
+        menu->addChild(createBoolMenuItem("Gesture looper", "Record, Play",
+            [=]() {
+                return module->looperEnabled;
+            },
+            [=](bool enabled) {
+                module->setLooperEnabled(enabled);
+            }
+        ));
+        if (module->looperEnabled) {
+            static const char* LOOPER_STATE_LABELS[] = {"empty", "armed", "recording", "playing", "overdubbing", "stopped"};
+            menu->addChild(createMenuLabel(string::f("Loop: %s, %d ticks, %u dropped events", LOOPER_STATE_LABELS[module->looper.state],
+                (int) (module->looper.length / module->looper.SUBTICKS), module->looper.overflows)));
+            menu->addChild(createMenuItem("Clear loop", "Shift+Record", [=]() {
+                module->looperClearRequested = true;
+            }));
+        }
+
+        menu->addChild(new MenuSeparator);
+        menu->addChild(createMenuLabel(string::f("Tap tempo: %.1f BPM", module->tapClock.bpm)));
+        menu->addChild(createBoolPtrMenuItem("Clock running", "Shift+Tap stops", &module->tapClock.running));
+        std::vector<std::string> ppqnLabels;
+        for (int ppqn : CLOCK_PPQNS) {
+            ppqnLabels.push_back(string::f("%d PPQN", ppqn));
+        }
+        menu->addChild(createIndexSubmenuItem("Clock resolution", ppqnLabels,
+            [=]() {
+                auto it = std::find(CLOCK_PPQNS.begin(), CLOCK_PPQNS.end(), module->tapClock.ppqn);
+                return it == CLOCK_PPQNS.end() ? 0 : it - CLOCK_PPQNS.begin();
+            },
+            [=](size_t i) {
+                module->tapClock.setPpqn(CLOCK_PPQNS[i]);
+            }
+        ));
     }
 };
 
@@ -0,0 +1,150 @@
+#include "plugin.hpp"
+#include "PulseBank.hpp"
+#include "Vpc40Expander.hpp"
+#include "vpc_protocol.hpp"
+
+// clip-launch rows of the grid
+#define CLIP_ROWS (LED_CLIP_LAUNCH_5 - LED_CLIP_LAUNCH_1 + 1)
+
+struct Vpc40ExpanderModule : Module {
+    enum ParamIds {
+        NUM_PARAMS
+    };
+    enum InputIds {
+        NUM_INPUTS
+    };
+    enum OutputIds {
+        SCENE_1_OUTPUT,
+        SCENE_2_OUTPUT,
+        SCENE_3_OUTPUT,
+        SCENE_4_OUTPUT,
+        SCENE_5_OUTPUT,
+        PLAY_OUTPUT,
+        STOP_OUTPUT,
+        RECORD_OUTPUT,
+        BANK_CHANGE_OUTPUT,
+        BANK_OUTPUT,
+        CLIP_ROW_1_OUTPUT,
+        CLIP_ROW_2_OUTPUT,
+        CLIP_ROW_3_OUTPUT,
+        CLIP_ROW_4_OUTPUT,
+        CLIP_ROW_5_OUTPUT,
+        NUM_OUTPUTS
+    };
+    enum LightIds {
+        CONNECTED_LIGHT,
+        NUM_LIGHTS
+    };
+    // trigger outputs, SCENE_1_OUTPUT to BANK_CHANGE_OUTPUT, are the channels of the pulse bank
+    static constexpr int NUM_PULSES = BANK_CHANGE_OUTPUT + 1;
+
+    // written by Vpc40Module on the left
+    ptone::Vpc40ExpanderMessage messages[2] = {};
+    ptone::Vpc40ExpanderMessage state = {};
+    ptone::PulseBank<NUM_PULSES> pulses;
+    dsp::ClockDivider lightDivider;
+    float sampleTime = 1 / 48000.f;
+
+    Vpc40ExpanderModule() {
+        config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
+        for (int i = 0; i < CLIP_ROWS; i++) {
+            configOutput(SCENE_1_OUTPUT + i, string::f("Scene %d trigger", i + 1));
+            configOutput(CLIP_ROW_1_OUTPUT + i, string::f("Clip row %d", i + 1))->description = "One channel per track, 10 V while the clip LED is lit";
+        }
+        configOutput(PLAY_OUTPUT, "Play trigger");
+        configOutput(STOP_OUTPUT, "Stop trigger");
+        configOutput(RECORD_OUTPUT, "Record trigger");
+        configOutput(BANK_CHANGE_OUTPUT, "Bank change trigger");
+        configOutput(BANK_OUTPUT, "Bank")->description = "0.5 V per bank, bank 1 is 0 V";
+        leftExpander.producerMessage = &messages[0];
+        leftExpander.consumerMessage = &messages[1];
+        lightDivider.setDivision(512);
+    }
+
+    void onSampleRateChange(const SampleRateChangeEvent& e) override {
+        sampleTime = e.sampleTime;
+    }
+
+    void process(const ProcessArgs& args) override {
+        bool connected = leftExpander.module && leftExpander.module->model == modelVpc40;
+        if (connected) {
+            const ptone::Vpc40ExpanderMessage* message = (const ptone::Vpc40ExpanderMessage*) leftExpander.consumerMessage;
+            if (message->sequence != state.sequence) {
+                applyMessage(*message);
+            }
+        }
+        if (pulses.isActive()) {
+            pulses.process([&](int g, simd::float_4 v) {
+                for (int i = 0; i < 4 && 4 * g + i < NUM_PULSES; i++) {
+                    outputs[4 * g + i].setVoltage(v[i]);
+                }
+            });
+        }
+        if (lightDivider.process()) {
+            lights[CONNECTED_LIGHT].setBrightness(connected ? 1.f : 0.f);
+        }
+    }
+
+    void applyMessage(const ptone::Vpc40ExpanderMessage& message) {
+        float triggerFrames = std::round(1e-3f / sampleTime);
+        for (int i = 0; i < CLIP_ROWS; i++) {
+            if (message.buttonPresses & (1 << (ptone::TRIGGER_SCENE_1 + i))) {
+                pulses.trigger(SCENE_1_OUTPUT + i, triggerFrames, 0.f);
+            }
+        }
+        if (message.buttonPresses & (1 << ptone::TRIGGER_PLAY)) {
+            pulses.trigger(PLAY_OUTPUT, triggerFrames, 0.f);
+        }
+        if (message.buttonPresses & (1 << ptone::TRIGGER_STOP)) {
+            pulses.trigger(STOP_OUTPUT, triggerFrames, 0.f);
+        }
+        if (message.buttonPresses & (1 << ptone::TRIGGER_RECORD)) {
+            pulses.trigger(RECORD_OUTPUT, triggerFrames, 0.f);
+        }
+        if (message.bank != state.bank) {
+            pulses.trigger(BANK_CHANGE_OUTPUT, triggerFrames, 0.f);
+        }
+        state = message;
+        writeStateOutputs();
+    }
+
+    void writeStateOutputs() {
+        outputs[BANK_OUTPUT].setVoltage(0.5f * state.bank);
+        for (int row = 0; row < CLIP_ROWS; row++) {
+            outputs[CLIP_ROW_1_OUTPUT + row].setChannels(CHAN_NUM);
+            for (int t = 0; t < CHAN_NUM; t++) {
+                bool lit = (state.clipLeds >> (row * CHAN_NUM + t)) & 1;
+                outputs[CLIP_ROW_1_OUTPUT + row].setVoltage(lit ? 10.f : 0.f, t);
+            }
+        }
+    }
+
+    void onPortChange(const PortChangeEvent& e) override {
+        if (e.connecting && e.type == rack::engine::Port::OUTPUT) {
+            writeStateOutputs();
+        }
+    }
+};
+
+struct Vpc40ExpanderWidget : ModuleWidget {
+    Vpc40ExpanderWidget(Vpc40ExpanderModule* module) {
+        setModule(module);
+        setPanel(APP->window->loadSvg(asset::plugin(pluginInstance, "res/expander.svg")));
+
+        addChild(createWidget<ThemedScrew>(Vec(RACK_GRID_WIDTH, 0)));
+        addChild(createWidget<ThemedScrew>(Vec(box.size.x - 2 * RACK_GRID_WIDTH, RACK_GRID_HEIGHT - RACK_GRID_WIDTH)));
+
+        addChild(createLightCentered<SmallLight<GreenLight>>(mm2px(Vec(25.4, 10)), module, Vpc40ExpanderModule::CONNECTED_LIGHT));
+        for (int i = 0; i < CLIP_ROWS; i++) {
+            addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(10.16, 25 + 15 * i)), module, Vpc40ExpanderModule::SCENE_1_OUTPUT + i));
+            addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(25.4, 25 + 15 * i)), module, Vpc40ExpanderModule::CLIP_ROW_1_OUTPUT + i));
+        }
+        addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(40.64, 25)), module, Vpc40ExpanderModule::PLAY_OUTPUT));
+        addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(40.64, 40)), module, Vpc40ExpanderModule::STOP_OUTPUT));
+        addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(40.64, 55)), module, Vpc40ExpanderModule::RECORD_OUTPUT));
+        addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(40.64, 70)), module, Vpc40ExpanderModule::BANK_CHANGE_OUTPUT));
+        addOutput(createOutputCentered<ThemedPJ301MPort>(mm2px(Vec(40.64, 85)), module, Vpc40ExpanderModule::BANK_OUTPUT));
+    }
+};
+
+Model* modelVpc40Expander = createModel<Vpc40ExpanderModule, Vpc40ExpanderWidget>("Vpc40Expander");
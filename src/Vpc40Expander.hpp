@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+
+namespace ptone {
+
+/** Buttons with a channel on the trigger and gate outputs of Vpc40Module, and a bit in Vpc40ExpanderMessage. */
+enum TriggerButton {
+    TRIGGER_PLAY,
+    TRIGGER_STOP,
+    TRIGGER_RECORD,
+    TRIGGER_UP,
+    TRIGGER_DOWN,
+    TRIGGER_STOP_ALL_CLIPS,
+    TRIGGER_SCENE_1,
+    TRIGGER_SCENE_2,
+    TRIGGER_SCENE_3,
+    TRIGGER_SCENE_4,
+    TRIGGER_SCENE_5,
+    TRIGGER_MASTER,
+    NUM_TRIGGER_BUTTONS
+};
+
+/** Controller state Vpc40Module sends to an expander on its right.
+It is a full snapshot, sent only when something changed.
+*/
+struct Vpc40ExpanderMessage {
+    // increases with every snapshot, so the expander applies each one once
+    uint32_t sequence;
+    uint8_t bank;
+    // one bit per TriggerButton: held, and pressed since the previous snapshot
+    uint16_t buttonGates;
+    uint16_t buttonPresses;
+    // lit clip-launch LEDs, bit row * 8 + track
+    uint64_t clipLeds;
+};
+
+} //namespace ptone